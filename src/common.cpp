@@ -3,8 +3,13 @@
 #include "common.h"
 
 
+void (*fatalHook)() = NULL;
+
+
 void _fatal(int code, const char* msg)
 {
+    if (fatalHook != NULL)
+        exchange(fatalHook, (void(*)())NULL)();  // not again if the hook fails
 #ifdef DEBUG
     fprintf(stderr, "\nInternal 0x%04x: %s\n", code, msg);
     // We want to see the stack backtrace in XCode debugger
@@ -18,6 +23,8 @@ void _fatal(int code, const char* msg)
 
 void _fatal(int code) 
 {
+    if (fatalHook != NULL)
+        exchange(fatalHook, (void(*)())NULL)();
 #ifdef DEBUG
     assert(code == 0);
 #else
@@ -80,5 +87,54 @@ atomicint pdecrement(atomicint* target) throw()
 
 #endif
 
+
+// --- THREADS ------------------------------------------------------------ //
+
+
+mutex::mutex(bool recursive) throw()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (recursive)
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+thread::thread() throw()
+    : handle(), running(false)  { }
+
+
+thread::~thread() throw()
+    { assert(!running); }
+
+
+void* thread::_threadproc(void* arg)
+{
+    ((thread*)arg)->execute();
+    return NULL;
+}
+
+
+void thread::start()
+{
+    assert(!running);
+    if (pthread_create(&handle, NULL, _threadproc, this) != 0)
+        fatal(0x0003, "Couldn't create thread");
+    running = true;
+}
+
+
+void thread::join() throw()
+{
+    if (running)
+    {
+        pthread_join(handle, NULL);
+        running = false;
+    }
+}
+
+
 #endif
 
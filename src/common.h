@@ -9,6 +9,7 @@
 
 // All standard library headers should go only here
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdint.h>
 #include <assert.h>
 #include <limits.h>
@@ -19,6 +20,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dlfcn.h>
+#ifdef __linux__
+#  include <sys/sendfile.h>
+#endif
+#ifdef SHN_THR
+#  include <pthread.h>
+#endif
 
 #include "version.h"
 
@@ -37,6 +44,11 @@
 // #define SHN_FASTER
 
 
+// Allocation profiler: counts object allocations per State and source line
+// and dumps a report at exit; works in release builds too (see allocprof)
+// #define SHN_PROFILE
+
+
 #define SOURCE_EXT ".shn"
 
 
@@ -78,6 +90,7 @@ typedef uchar* puchar;
 
 void _fatal(int code, const char* msg);
 void _fatal(int code);
+extern void (*fatalHook)();  // called by _fatal() before the message, e.g. to flush output
 
 #ifdef DEBUG
 #  define fatal(code,msg)  _fatal(code, msg)
@@ -99,6 +112,23 @@ template <class T>
         { T temp = target; target = value; return temp; }
 
 
+// Combines two hash values
+inline uinteger _hashmix(uinteger h, uinteger v)
+    { return h ^ (v + uinteger(0x9e3779b9) + (h << 6) + (h >> 2)); }
+
+
+// Bit counting for word-parallel set operations; lowbit() is undefined for 0
+#ifdef __GNUC__
+inline int bitcount(uinteger w)     { return __builtin_popcountll(w); }
+inline int lowbit(uinteger w)       { return __builtin_ctzll(w); }
+#else
+inline int bitcount(uinteger w)
+    { int c = 0; for (; w; w &= w - 1) c++; return c; }
+inline int lowbit(uinteger w)
+    { int c = 0; for (; !(w & 1); w >>= 1) c++; return c; }
+#endif
+
+
 template <class T, class X>
     inline T cast(const X& x)  
 #ifdef DEBUG
@@ -175,4 +205,113 @@ typedef int atomicint;
 #endif
 
 
+// --- THREADS ------------------------------------------------------------ //
+
+
+#ifdef SHN_THR
+
+class condvar;
+
+class mutex: noncopyable
+{
+    friend class condvar;
+protected:
+    pthread_mutex_t mtx;
+public:
+    mutex() throw()                 { pthread_mutex_init(&mtx, NULL); }
+    mutex(bool recursive) throw();  // a recursive mutex can be re-entered by its owner thread
+    ~mutex() throw()                { pthread_mutex_destroy(&mtx); }
+    void enter() throw()            { pthread_mutex_lock(&mtx); }
+    void leave() throw()            { pthread_mutex_unlock(&mtx); }
+};
+
+
+class scopelock: noncopyable
+{
+protected:
+    mutex& mtx;
+public:
+    scopelock(mutex& m) throw()     : mtx(m)  { mtx.enter(); }
+    ~scopelock() throw()            { mtx.leave(); }
+};
+
+
+class condvar: noncopyable
+{
+protected:
+    pthread_cond_t cond;
+public:
+    condvar() throw()               { pthread_cond_init(&cond, NULL); }
+    ~condvar() throw()              { pthread_cond_destroy(&cond); }
+    void wait(mutex& m) throw()     { pthread_cond_wait(&cond, &m.mtx); }
+    void signal() throw()           { pthread_cond_signal(&cond); }
+    void broadcast() throw()        { pthread_cond_broadcast(&cond); }
+};
+
+
+// Descendants implement execute(); the thread should be joined before
+// the object is destroyed.
+class thread: noncopyable
+{
+protected:
+    pthread_t handle;
+    bool running;
+    static void* _threadproc(void*);
+    virtual void execute() = 0;
+public:
+    thread() throw();
+    virtual ~thread() throw();
+    void start();
+    void join() throw();
+};
+
+#endif // SHN_THR
+
+
+// --- SUBSYSTEM INITIALIZATION ------------------------------------------- //
+
+
+// The init/done functions of the subsystems (initRuntime() etc.) can be
+// called by more than one embedder or thread: each subsystem keeps a static
+// initcount, and an initscope in both functions tells whether it's the
+// first init or the last done, i.e. whether the work is needed. The
+// work is done under the scope's lock, so that other threads wait until the
+// subsystem is ready.
+
+class initcount: noncopyable
+{
+    friend class initscope;
+protected:
+#ifdef SHN_THR
+    mutex mtx;
+#endif
+    int count;
+public:
+    initcount() throw(): count(0)  { }
+};
+
+
+class initscope: noncopyable
+{
+protected:
+    initcount& ic;
+    bool first;
+public:
+    initscope(initcount& c, bool init) throw(): ic(c)
+    {
+#ifdef SHN_THR
+        ic.mtx.enter();
+#endif
+        first = init ? ic.count++ == 0 : --ic.count == 0;
+    }
+    ~initscope() throw()
+    {
+#ifdef SHN_THR
+        ic.mtx.leave();
+#endif
+    }
+    bool needed() const             { return first; }
+};
+
+
 #endif // __COMMON_H
@@ -73,7 +73,8 @@ Type* Compiler::getStateDerivator(Type* retType, bool allowProto)
     else
     {
         State* newState = state->registerType(new State(state, proto));
-        stateBody(newState);
+        if (!deferBody(newState))
+            stateBody(newState);
         return newState;
     }
 }
@@ -156,7 +157,7 @@ void Compiler::identifier(str ident)
     do
     {
         // TODO: implement loading from outer scopes
-        Symbol* sym = sc->find(ident);
+        Symbol* sym = findVisible(sc, ident);
         if (sym)
         {
             if (sym->isBuiltin())
@@ -170,7 +171,7 @@ void Compiler::identifier(str ident)
     while (sc != NULL);
 
     // Look up in used modules; search backwards
-    for (memint i = module->usedModuleVars.size(); i--; )
+    for (memint i = deferred ? deferred->usedModules : module->usedModuleVars.size(); i--; )
     {
         InnerVar* m = module->usedModuleVars[i];
         Symbol* sym = m->getModuleType()->find(ident);
@@ -213,11 +214,11 @@ void Compiler::dotIdentifier(str ident)
         // state names are by default transformed into function pointers, we 
         // need to roll it back
         codegen->implicitCast(defTypeRef, "Invalid member selection");
-        codegen->loadSymbol(codegen->undoStateRef()->findShallow(ident));
+        codegen->loadSymbol(findMember(codegen->undoStateRef(), ident));
     }
     else if (type->isAnyState())
         // State object (variable or subexpr) on the stack followed by '.' and member:
-        codegen->loadMember(PState(type), PState(type)->findShallow(ident));
+        codegen->loadMember(PState(type), findMember(PState(type), ident));
     else
         error("Invalid member selection");
 }
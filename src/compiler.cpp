@@ -57,10 +57,37 @@ void Compiler::LoopInfo::resolveJumps()
 }
 
 
+DeferredBody::DeferredBody(Context& c, Module* m, const str& src, const str& fn, integer ln) throw()
+    : PendingBody(), context(c), module(m), source(src), fileName(fn),
+      linenum(ln), visible(), usedModules(0)  { }
+
+
+DeferredBody::~DeferredBody() throw()
+    { }
+
+
+void DeferredBody::compile(State* state)
+{
+    Compiler compiler(this);
+    compiler.compileDeferred(state);
+}
+
+
+ecompiled::ecompiled(const str& msg) throw(): emessage(msg)  { }
+ecompiled::~ecompiled() throw()  { }
+
+
 Compiler::Compiler(Context& c, Module* mod, buffifo* f)
     : Parser(f), context(c), constStack(c.options.stackSize),
       module(mod), scope(NULL), state(NULL),
-      loopInfo(NULL), returnInfo(NULL)  { }
+      loopInfo(NULL), returnInfo(NULL), deferred(NULL)  { }
+
+
+Compiler::Compiler(DeferredBody* body)
+    : Parser(new strfifo(NULL, body->source), body->fileName, body->linenum),
+      context(body->context), constStack(context.options.stackSize),
+      module(body->module), scope(NULL), state(NULL),
+      loopInfo(NULL), returnInfo(NULL), deferred(body)  { }
 
 
 Compiler::~Compiler()
@@ -236,6 +263,8 @@ void Compiler::singleStatement()
         dumpVar();
     else if (skipIf(tokExit))
         programExit();
+    else if (token == tokUses)
+        error("'uses' is allowed only at the beginning of a module");
     else
         otherStatement();
 
@@ -528,19 +557,11 @@ void Compiler::forBlock()
         StkVar* ctlVar = local.addInitStkVar(ident, idxType);
         {
             LoopInfo loop(*this);
-            if (iterType->isByteSet())
-            {
-                codegen->loadConst(idxType, idxType->right);
-                codegen->stkVarCmp(ctlVar, opGreaterThan);
-            }
-            else
-                codegen->stkVarCmpLength(ctlVar, contVar);
-            memint out = codegen->boolJumpForward(opJumpTrue);
-            // TODO: optimize this?
-            codegen->loadStkVar(ctlVar);
+            // Skip straight to the next element rather than testing each
+            // value of the index range
             codegen->loadStkVar(contVar);
-            codegen->inCont();
-            memint inc = codegen->boolJumpForward(opJumpFalse);
+            codegen->stkVarNextElem(ctlVar);
+            memint out = codegen->boolJumpForward(opJumpTrue);
             if (!ident2.empty()) // dict only
             {
                 AutoScope inner(this);
@@ -554,7 +575,36 @@ void Compiler::forBlock()
             }
             else
                 nestedBlock();
-            forBlockTail(ctlVar, out, inc);
+            forBlockTail(ctlVar, out);
+        }
+    }
+
+    // Int sets: like byte sets, the loop variable moves straight to the next
+    // element, so that the set itself holds no iteration state. The element
+    // count guards against the variable wrapping around after the maximum
+    // integer.
+    else if (iterType->isIntSet())
+    {
+        if (!ident2.empty())
+            error("Key/value pair is not allowed for set loops");
+        Container* contType = PContainer(iterType);
+        Ordinal* idxType = POrdinal(contType->index);
+        StkVar* contVar = local.addInitStkVar(LOCAL_ITERATOR_NAME, contType);
+        codegen->loadConst(queenBee->defInt, 0);
+        StkVar* cntVar = local.addInitStkVar(LOCAL_INDEX_NAME, queenBee->defInt);
+        codegen->loadConst(idxType, idxType->left);
+        StkVar* ctlVar = local.addInitStkVar(ident, idxType);
+        {
+            LoopInfo loop(*this);
+            codegen->stkVarCmpLength(cntVar, contVar);
+            memint out = codegen->boolJumpForward(opJumpTrue);
+            codegen->loadStkVar(contVar);
+            codegen->stkVarNextElem(ctlVar);
+            memint end = codegen->boolJumpForward(opJumpTrue);
+            nestedBlock();
+            codegen->incStkVar(cntVar);
+            forBlockTail(ctlVar, out);
+            codegen->resolveJump(end);
         }
     }
 
@@ -591,6 +641,26 @@ void Compiler::forBlock()
         }
     }
 
+    // Lines of a character fifo; the variable is reused for each line
+    else if (iterType->isByteFifo())
+    {
+        if (!ident2.empty())
+            error("Key/value pair is not allowed for fifo loops");
+        StkVar* fifoVar = local.addInitStkVar(LOCAL_ITERATOR_NAME, iterType);
+        codegen->loadConst(queenBee->defStr, str());
+        StkVar* ctlVar = local.addInitStkVar(ident, queenBee->defStr);
+        {
+            LoopInfo loop(*this);
+            codegen->loadStkVar(fifoVar);
+            codegen->stkVarNextElem(ctlVar);
+            memint out = codegen->boolJumpForward(opJumpTrue);
+            nestedBlock();
+            codegen->jump(loopInfo->continueTarget);
+            codegen->resolveJump(out);
+            loopInfo->resolveJumps();
+        }
+    }
+
     else
         error("Invalid iterator type in 'for' statement");
     local.deinitLocals();
@@ -639,6 +709,64 @@ void Compiler::doReturn()
 }
 
 
+bool Compiler::deferBody(State* newState)
+{
+    // Bodies in curly brackets are skipped here and compiled when the function
+    // is first referenced (see CodeGen::loadTypeRef()), so that functions that
+    // are never used cost only a lexical scan. The eager mode is used when all
+    // of the code should be checked for errors or be ready to run, and also
+    // for cached modules as they are shared by contexts.
+    if (isRecording() || !context.options.lazyBodies || context.options.compileOnly
+            || context.options.moduleCache)
+        return false;
+    if (token == tokSep)
+    {
+        // The block may start on the next line, see skipMultiBlockBegin()
+        skipWsSeps();
+        if (token != tokLCurly)
+            error("':' or '{' expected");
+    }
+    else if (token != tokLCurly)
+        return false;
+    integer ln = getLineNum();
+    str source = skipMultiBlock();
+    objptr<DeferredBody> body = new DeferredBody(context, module, source, getFileName(), ln);
+    for (Scope* sc = newState->outer; sc != NULL; sc = sc->outer)
+    {
+        DeferredBody::VisibleScope v = { sc, sc->symbolCount() };
+        if (deferred)  // nested within a deferred body: inherit its restrictions
+            for (memint i = 0; i < deferred->visible.size(); i++)
+                if (deferred->visible[i].scope == sc)
+                    v.count = imin(v.count, deferred->visible[i].count);
+        body->visible.push_back(v);
+    }
+    body->usedModules = deferred ? deferred->usedModules : module->usedModuleVars.size();
+    newState->deferBody(body);
+    return true;
+}
+
+
+Symbol* Compiler::findVisible(Scope* sc, const str& ident) const
+{
+    // Symbols defined in outer scopes after a deferred function are not
+    // visible to it, same as if it was compiled at the point of definition
+    if (deferred)
+        for (memint i = 0; i < deferred->visible.size(); i++)
+            if (deferred->visible[i].scope == sc)
+                return sc->find(ident, deferred->visible[i].count);
+    return sc->find(ident);
+}
+
+
+Symbol* Compiler::findMember(State* st, const str& ident) const
+{
+    Symbol* sym = findVisible(st, ident);
+    if (sym == NULL)
+        throw EUnknownIdent(ident);
+    return sym;
+}
+
+
 void Compiler::stateBody(State* newState)
 {
     CodeGen newCodeGen(*newState->getCodeSeg(), module, newState, false);
@@ -685,6 +813,10 @@ void Compiler::compileModule()
             codegen->prolog();
             next();
             skipWsSeps();
+            strvec uses;
+            usesClauses(uses);
+            for (memint i = 0; i < uses.size(); i++)
+                module->addUsedModule(context.getModule(uses[i]));
             statementList();
             expect(tokEof, "End of file");
             ret.resolveJumps();
@@ -701,20 +833,66 @@ void Compiler::compileModule()
             error("'" + e.ident + "' is unknown in this context");
         }
     }
+    catch (ecompiled&)
+    {
+        throw;  // error in a deferred function body
+    }
     catch (exception& e)
     {
-        str s;
-        if (!getFileName().empty())
-        {
-            s += getFileName() + '(' + to_string(getLineNum()) + ')';
-            if (!strValue.empty() || token == tokStrValue)  // may be an empty string literal
-                s += " near '" + to_displayable(to_printable(strValue)) + '\'';
-            s += ": ";
-        }
-        s += e.what();
-        error(s);
+        locatedError(e);
     }
     module->setComplete();
     module->registerCodeSeg(module->getCodeSeg());
 }
 
+
+void Compiler::compileDeferred(State* newState)
+{
+    // The body is compiled in the context of its definition, i.e. within the
+    // parent state; the local scopes of the parent are never visible to it
+    scope = state = newState->parent;
+    codegen = NULL;
+    try
+    {
+        try
+        {
+            next();
+            stateBody(newState);
+            expect(tokEof, "End of file");
+        }
+        catch (EDuplicate& e)
+        {
+            strValue.clear();
+            error("'" + e.ident + "' is already defined within this scope");
+        }
+        catch (EUnknownIdent& e)
+        {
+            strValue.clear();
+            error("'" + e.ident + "' is unknown in this context");
+        }
+    }
+    catch (ecompiled&)
+    {
+        throw;
+    }
+    catch (exception& e)
+    {
+        locatedError(e);
+    }
+}
+
+
+void Compiler::locatedError(exception& e)
+{
+    str s;
+    if (!getFileName().empty())
+    {
+        s += getFileName() + '(' + to_string(getLineNum()) + ')';
+        if (!strValue.empty() || token == tokStrValue)  // may be an empty string literal
+            s += " near '" + to_displayable(to_printable(strValue)) + '\'';
+        s += ": ";
+    }
+    s += e.what();
+    throw ecompiled(s);
+}
+
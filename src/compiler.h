@@ -5,6 +5,41 @@
 #include "typesys.h"
 
 
+// Function body whose compilation is deferred until the function is first
+// referenced, see Compiler::deferBody(). Along with the source text it keeps
+// the number of symbols each outer scope had at the point of definition so
+// that later definitions don't become visible to the body.
+class DeferredBody: public PendingBody
+{
+    friend class Compiler;
+protected:
+    struct VisibleScope
+    {
+        Scope* scope;
+        memint count;
+    };
+    Context& context;
+    Module* const module;
+    str const source;
+    str const fileName;
+    integer const linenum;
+    podvec<VisibleScope> visible;
+    memint usedModules;
+public:
+    DeferredBody(Context&, Module*, const str& source, const str& fileName, integer linenum) throw();
+    ~DeferredBody() throw();
+    void compile(State*); // override
+};
+
+
+// Compilation error that already includes the source location
+struct ecompiled: public emessage
+{
+    ecompiled(const str& msg) throw();
+    ~ecompiled() throw();
+};
+
+
 class Compiler: public Parser
 {
     friend class Context;
@@ -51,6 +86,7 @@ public:
     State* state;           // for this-vars, type objects and definitions
     LoopInfo* loopInfo;
     ReturnInfo* returnInfo;
+    DeferredBody* deferred; // non-NULL when compiling a deferred function body
 
     bool isLocalScope() const
         { return scope != state; }
@@ -111,11 +147,17 @@ public:
     void doContinue();
     void doBreak();
     void doReturn();
+    bool deferBody(State*);
     void stateBody(State*);
+    Symbol* findVisible(Scope*, const str&) const;     // NULL if not found
+    Symbol* findMember(State*, const str&) const;      // throws EUnknownIdent
+    void locatedError(exception&);
 
     void compileModule();
+    void compileDeferred(State*);
 
     Compiler(Context&, Module*, buffifo*);
+    Compiler(DeferredBody*);
     ~Compiler();
 };
 
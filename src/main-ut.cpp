@@ -6,6 +6,8 @@
 #include "vm.h"
 #include "compiler.h"
 
+#include <sys/time.h>
+
 
 static void ut_fail(unsigned line, const char* e)
 {
@@ -33,6 +35,42 @@ static void ut_fail(unsigned line, const char* e)
 #  define INTEGER_MIN_STR "-2147483648"
 #endif
 
+#ifdef XCODE
+#  define TESTS_DIR "../../src/tests/"
+#else
+#  define TESTS_DIR "tests/"
+#endif
+
+
+// A unique temporary directory for the files that tests write; the files
+// obtained with file() are removed along with the directory
+
+class tempdir: public noncopyable
+{
+    char dir[32];
+    strvec files;
+public:
+    tempdir()
+    {
+        strcpy(dir, "/tmp/shannon-ut-XXXXXX");
+        if (::mkdtemp(dir) == NULL)
+            fail("mkdtemp");
+    }
+    ~tempdir()
+    {
+        for (memint i = 0; i < files.size(); i++)
+        {
+            str f = files[i];
+            ::remove(f.c_str());
+        }
+        ::rmdir(dir);
+    }
+    str path() const
+        { return dir; }
+    str file(const char* name)
+        { str f = path() + '/' + name; files.push_back(f); return f; }
+};
+
 
 static void test_common()
 {
@@ -87,6 +125,212 @@ static void test_ordset()
     check(!s2.empty());
     ordset s3;
     s3 = s1;
+
+    charset c;
+    check(c.next(0) == -1);
+    c.include(3);
+    c.include(64);
+    c.include(200, 255);
+    check(c.next(0) == 3 && c.next(3) == 3 && c.next(4) == 64);
+    check(c.next(65) == 200 && c.next(255) == 255 && c.next(256) == -1);
+
+    const char* s = "abc def\r\nxyz";
+    const char* e = s + strlen(s);
+    check(charset("a-z").span(s, e) == s + 3);
+    check(charset("a-z").span(s + 3, e) == s + 3);
+    check((~charset("\r\n")).span(s, e) == s + 7);
+    check((~charset("\r\n")).span(s + 9, e) == e);
+    charset all;
+    all.fill();
+    check(all.span(s, e) == e);
+
+    charscan eol(~charset("\r\n")), alpha(charset("a-z"));
+    check(alpha.span(s, e) == s + 3 && alpha.span(s + 3, e) == s + 3);
+    check(eol.span(s, e) == s + 7 && eol.span(s + 9, e) == e);
+    check(charscan(all).span(s, e) == e && charscan(charset()).span(s, e) == s);
+    for (int i = 0; i < 60; i++)  // word-wise scanning at all alignments
+    {
+        const char* l = "0123456789012345678901234567890123456789012345678901234567890123\n";
+        check(charscan(~charset("\n")).span(l + i, l + 65) == l + 64);
+        check(charscan(~charset("\t\n")).span(l + i, l + 60) == l + 60);
+        check(charscan(charset("0-9")).span(l + i, l + 65) == l + 64);
+        check(charscan(charset("0-9A-Za-z_")).span(l + i, l + 63) == l + 63);
+        check(charscan(charset("1-9")).span(l + i, l + 65) == l + (i % 10 ? 10 - i % 10 + i : i));
+    }
+}
+
+
+void test_intset()
+{
+    intset s1;
+    check(s1.empty());
+    check(s1.size() == 0);
+    s1.find_insert(1000);
+    s1.find_insert(-5);
+    s1.find_insert(70000);
+    check(s1.size() == 3);
+    check(s1.find(1000) && s1.find(-5) && s1.find(70000));
+    check(!s1.find(0) && !s1.find(999) && !s1.find(-70000));
+    check(s1.at(0) == -5 && s1.at(1) == 1000 && s1.at(2) == 70000);
+    check(s1.obj->blocks.size() == 3);
+
+    // Copies share blocks until modified
+    intset s2 = s1;
+    s2.find_erase(1000);
+    check(s1.find(1000) && !s2.find(1000));
+    check(s2.size() == 2);
+    check(s1 != s2);
+    try { s2.find_erase(1000); check(false); } catch (exception&) { }
+    s2.find_erase(-5);
+    s2.find_erase(70000);
+    check(s2.empty());
+
+    // Array -> bitmap conversion and back
+    intset s3;
+    for (integer i = 0; i < 10000; i += 2)
+        s3.find_insert(i);
+    check(s3.size() == 5000);
+    check(s3.obj->blocks[0]->kind == intset::block::BITMAP);
+    for (integer i = 0; i < 10000; i++)
+        check(s3.find(i) == !(i & 1));
+    for (memint i = 0; i < s3.size(); i++)
+        check(s3.at(i) == i * 2);
+    check(s3.at(17) == 34);  // random access after sequential
+    {
+        // Independent cursors over the same set
+        intset::cursor c1, c2;
+        for (memint i = 0; i < 100; i++)
+            check(s3.at(i, c1) == i * 2 && s3.at(99 - i, c2) == (99 - i) * 2);
+    }
+    for (integer i = 0; i < 4000; i += 2)
+        s3.find_erase(i);
+    check(s3.size() == 3000);
+    check(s3.obj->blocks[0]->kind == intset::block::ARRAY);
+    check(s3.at(0) == 4000);
+
+    // Ranges and runs
+    intset s4(-100, 200000);
+    check(s4.size() == 200101);
+    check(s4.find(-100) && s4.find(0) && s4.find(200000));
+    check(!s4.find(-101) && !s4.find(200001));
+    s4.optimize();
+    check(s4.obj->blocks[1]->kind == intset::block::RUNS);
+    check(s4.find(65536) && s4.at(100) == 0 && s4.at(200100) == 200000);
+    s4.find_erase(65536);
+    check(!s4.find(65536) && s4.find(65537) && s4.size() == 200100);
+    integer v = -1000;
+    check(s4.next(v) && v == -100);
+    v = 65536;
+    check(s4.next(v) && v == 65537);
+    v = 200001;
+    check(!s4.next(v));
+
+    // Single changes keep runs as runs
+    intset s5(100, 200);
+    s5.optimize();
+    s5.find_insert(1000);
+    s5.find_insert(999);
+    s5.find_insert(202);
+    s5.find_insert(201);
+    s5.find_insert(150);
+    s5.find_erase(150);
+    s5.find_erase(100);
+    check(s5.obj->blocks[0]->kind == intset::block::RUNS);
+    check(s5.obj->blocks[0]->arr.size() == 6);
+    check(s5.size() == 103);
+    check(!s5.find(100) && !s5.find(150) && s5.find(149) && s5.find(151) && s5.find(202) && !s5.find(203));
+    check(s5.at(0) == 101 && s5.at(49) == 151 && s5.at(101) == 999 && s5.at(102) == 1000);
+    v = 150;
+    check(s5.next(v) && v == 151);
+    v = 203;
+    check(s5.next(v) && v == 999);
+    s5.find_insert(150);
+    check(s5.obj->blocks[0]->arr.size() == 4 && s5.find(150));
+    intset s6(0, 3);
+    s6.optimize();
+    s6.find_insert(10);
+    check(s6.obj->blocks[0]->kind == intset::block::RUNS);
+    s6.find_insert(20);
+    check(s6.obj->blocks[0]->kind == intset::block::ARRAY);
+    check(s6.size() == 6 && s6.at(3) == 3 && s6.at(4) == 10 && s6.at(5) == 20);
+
+    v = 7;
+    check(s3.next(v) && v == 4000);
+    v = 4001;
+    check(s3.next(v) && v == 4002);
+    v = 9999;
+    check(!s3.next(v));
+
+    // Set operations
+    intset a(0, 9999), b(5000, 14999);
+    intset c = a;
+    c.unite(b);
+    check(c.size() == 15000 && c.at(14999) == 14999);
+    c = a;
+    c.intersect(b);
+    check(c.size() == 5000 && c.at(0) == 5000);
+    c = a;
+    c.subtract(b);
+    check(c.size() == 5000 && c.at(4999) == 4999);
+    check(a.size() == 10000 && b.size() == 10000);
+
+    // Every combination of block kinds, checked value by value
+    intset kinds[5];
+    for (integer i = 0; i < 10000; i += 7)
+        kinds[0].find_insert(i);
+    for (integer i = 0; i < 3000; i += 3)
+        kinds[1].find_insert(i);
+    for (integer i = 1; i < 10000; i += 2)
+        kinds[2].find_insert(i);
+    kinds[3].find_insert(100, 300);
+    kinds[3].find_insert(1000, 5000);
+    kinds[3].find_insert(7000, 7010);
+    kinds[4].find_insert(250, 1500);
+    kinds[4].find_insert(4990, 8000);
+    kinds[3].optimize();
+    kinds[4].optimize();
+    check(kinds[0].obj->blocks[0]->kind == intset::block::ARRAY);
+    check(kinds[2].obj->blocks[0]->kind == intset::block::BITMAP);
+    check(kinds[3].obj->blocks[0]->kind == intset::block::RUNS);
+    for (int i = 0; i < 5; i++)
+        for (int j = 0; j < 5; j++)
+            for (int op = 0; op < 3; op++)
+            {
+                intset r = kinds[i];
+                if (op == 0)
+                    r.unite(kinds[j]);
+                else if (op == 1)
+                    r.intersect(kinds[j]);
+                else
+                    r.subtract(kinds[j]);
+                memint count = 0;
+                for (integer k = 0; k < 10000; k++)
+                {
+                    bool x = kinds[i].find(k), y = kinds[j].find(k);
+                    bool e = op == 0 ? x || y : op == 1 ? x && y : x && !y;
+                    check(r.find(k) == e);
+                    count += e;
+                }
+                check(r.size() == count);
+            }
+    c = kinds[3];
+    c.unite(kinds[4]);
+    check(c.obj->blocks[0]->kind == intset::block::RUNS);
+    check(c.obj->blocks[0]->arr.size() == 2 && c.size() == 7901);
+
+    // Comparison and hashing don't depend on the internal representation
+    intset d, e(3, 5);
+    d.find_insert(5); d.find_insert(4); d.find_insert(3);
+    e.optimize();
+    check(d == e);
+    check(d.hash() == e.hash());
+    check(d.compare(intset(3, 6)) < 0);
+
+    variant v1 = d, v2 = e;
+    check(v1.is(variant::INTSET));
+    check(v1 == v2);
+    check(v1.hash() == v2.hash());
+    check(!v1.empty());
 }
 
 
@@ -279,6 +523,28 @@ void test_string()
     s8.clear();
     s8.insert(0, "DEF");
     check(s8 == "DEF");
+
+    {
+        str s9 = "interned";
+        str s10 = str("inter") + "ned";
+        check(s9.data() != s10.data());
+        memint n = strPool.size();
+        strPool.intern(s9);
+        strPool.intern(s10);
+        check(s9.data() == s10.data());
+        check(strPool.size() == n + 1);
+        strpool local;
+        str s11 = str("inter") + "ned";
+        check(!local.find(s11));
+        local.intern(s9);
+        check(local.find(s11) && s11.data() == s9.data());
+        local.clear();
+        s11.clear();
+        s9.clear();
+        s10.clear();
+        strPool.purge();
+        check(strPool.size() == n);
+    }
 }
 
 
@@ -293,6 +559,86 @@ static void test_strutils()
     check(to_string(integer(123456789)) == "123456789");
     check(to_string(-123, 10, 7, '0') == "-000123");
     check(to_string(0xabcde, 16, 6) == "0ABCDE");
+    check(to_string(integer(10)) == "10" && to_string(integer(99)) == "99"
+        && to_string(integer(100)) == "100" && to_string(integer(-1005)) == "-1005");
+    check(to_string(5, 2) == "101" && to_string(-1, 8) == "1777777777777777777777");
+    {
+        strfifo f(NULL);
+        f << integer(-42) << ' ' << INTEGER_MIN << ' ';
+        f.fmt(7, 3).fmt(-7, 3, '0').fmt(7, -3, '*').fmt(255, 0, ' ', 16);
+        check(f.all() == "-42 " INTEGER_MIN_STR "   7-07" "7**FF");
+        check_throw(f.fmt(1, 0, ' ', 1));
+    }
+    {
+        // Numbers that span chunk boundaries
+        memfifo f(NULL, true);
+        for (int i = 0; i < 200; i++)
+            f.fmt(i * 7919 - 1000).enq(' ');
+        integer v;
+        bool o;
+        for (int i = 0; i < 200; i++)
+        {
+            check(f.deq_int(&v, &o) && !o && v == i * 7919 - 1000);
+            f.get();
+        }
+        check(!f.deq_int(&v, &o));
+        f << INTEGER_MAX_STR " " INTEGER_MAX_STR_PLUS " " INTEGER_MIN_STR " -" INTEGER_MAX_STR_PLUS "0 -z 7fF";
+        check(f.deq_int(&v, &o) && !o && v == INTEGER_MAX);
+        f.get();
+        check(f.deq_int(&v, &o) && o && v == 0);
+        f.get();
+        check(f.deq_int(&v, &o) && !o && v == INTEGER_MIN);
+        f.get();
+        check(f.deq_int(&v, &o) && o);
+        f.get();
+        check(!f.deq_int(&v, &o) && f.preview() == '-');
+        f.get(); f.get(); f.get();
+        check(f.deq_int(&v, &o, 16) && v == 0x7ff && f.empty());
+        f << "1, 2,3 4\n5 x";
+        podvec<integer> ints;
+        check(f.deq_ints(ints, 100, charset(" ,\n")) == 5);
+        check(ints.size() == 5 && ints[0] == 1 && ints[4] == 5);
+        check(f.get() == 'x');
+        f << "1 " INTEGER_MAX_STR_PLUS;
+        check_throw(f.deq_ints(ints, 100, charset(" ")));
+        // A sign at the end of a chunk or at eof stays in the fifo unless
+        // a digit follows it
+        for (int k = 1; k < memfifo::CHUNK_SIZE * 2; k++)
+        {
+            memfifo g(NULL, true);
+            g << str(k, 'x') << "-7 +x -";
+            g.deq(k);
+            check(g.deq_int(&v, &o) && !o && v == -7);
+            g.get();
+            check(!g.deq_int(&v, &o) && g.get() == '+' && g.get() == 'x');
+            g.get();
+            check(!g.deq_int(&v, &o) && g.get() == '-' && g.empty());
+        }
+    }
+    {
+        memfifo f(NULL, true);
+        str s;
+        check(!f.next_line(s));
+        for (int i = 0; i < 20; i++)
+            f << "line " << i << "\r\n";
+        f << "\nlast";
+        for (int i = 0; i < 20; i++)
+            check(f.next_line(s) && s == "line " + to_string(i));
+        check(f.next_line(s) && s.empty());
+        check(f.next_line(s) && s == "last");
+        check(!f.next_line(s) && f.empty());
+        f << "abcdef\nabc\n";
+        check(f.next_line(s) && s == "abcdef");
+        const char* prev = s.data();
+        check(f.next_line(s) && s == "abc" && s.data() == prev);  // buffer reused
+        str t = s;
+        check(!f.next_line(s) && s.empty() && t == "abc");
+        str l(memfifo::CHUNK_SIZE * 3 + 5, 'x');
+        f << l << "\n" << l;
+        check(f.next_line(s) && s == l);  // spans chunks
+        check(f.next_line(s) && s == l);
+        check(!f.next_line(s));
+    }
     
     bool e = true, o = true;
     check(from_string("0", &e, &o) == 0);
@@ -397,6 +743,10 @@ static void test_vector()
     v1.replace(2, "MNO");
     check(v1[2] == "MNO");
     check(v3[2] == "JKL");
+    v2 = v3;
+    v3.clear();
+    check(v3.empty());
+    check(v2.size() == 3 && v2[2] == "JKL");
 }
 
 
@@ -454,10 +804,32 @@ static void test_symtbl()
 {
     symtbl_impl s1;
     objptr<symbol> p1 = new symbol("abc");
-    s1.insert(0, p1.get());
+    check(s1.find("abc") == NULL);
+    check(s1.add(p1.get()));
     check(s1[0] == p1.get());
     check(s1.at(0) == p1.get());
     check(s1.back() == p1.get());
+    check(!s1.add(p1.get()));
+    check(s1.find("abc") == p1.get());
+    check(s1.find(p1->name) == p1.get());
+    check(s1.find("abd") == NULL);
+    objptr<symbol> p2 = new symbol("abc");
+    check(s1.replace(p2.get()));
+    check(s1.find("abc") == p2.get());
+    objvec<symbol> v;
+    for (int i = 0; i < 1000; i++)
+    {
+        str s = to_string(i);
+        symbol* p = v.push_back(new symbol(s));
+        p->grab();
+        check(s1.add(p));
+    }
+    check(s1.size() == 1001);
+    check(s1[1] == v[0]);
+    for (int i = 0; i < 1000; i++)
+        check(s1.find(to_string(i)) == v[i]);
+    check(s1.find("1000") == NULL);
+    v.release_all();
 }
 
 
@@ -525,6 +897,38 @@ void test_variant()
         check(v2.as_range().right() == 20);
         check(v1.compare(v2) == -1);
     }
+    {
+        // deep comparison and structural hashing
+        varvec a, b;
+        a.push_back(1); a.push_back("abc");
+        b.push_back(1); b.push_back("abc");
+        variant v1 = a, v2 = b;
+        check(v1 == v2);
+        check(v1.compare(v2) == 0);
+        check(v1.hash() == v2.hash());
+        v2.as_vec().push_back(0);
+        check(v1 != v2);
+        check(v1.compare(v2) < 0);
+        check(v1.hash() != v2.hash());
+        v2.as_vec().pop_back();
+        check(v1 == v2);
+        check(v1.hash() == v2.hash());
+        v2.as_vec().replace(1, "abd");
+        check(v1.compare(v2) < 0);
+        check(v1.hash() != v2.hash());
+        varset s;
+        s.find_insert(v1);
+        s.find_insert(v2);
+        check(!s.find_insert(a));
+        check(s.size() == 2);
+        vardict d1, d2;
+        d1.find_replace(v1, 1);
+        d2.find_replace(a, 1);
+        check(variant(d1) == variant(d2));
+        check(variant(d1).hash() == variant(d2).hash());
+        d2.find_replace(a, 2);
+        check(variant(d1) != variant(d2));
+    }
 }
 
 
@@ -556,9 +960,39 @@ static void test_bidir_char_fifo(fifo& fc)
     check(fc.deq("0-9") == "0123456789");
     check(fc.deq("a-z") == "abcdefghijklmnopqrstuvwxyz");
     check(fc.empty());
+
+    fc.enq("abcdefghijklmnopqrstuvwxyzabcdefghij!");
+    check(fc.deq("a-z") == "abcdefghijklmnopqrstuvwxyzabcdefghij");  // long token
+    check(fc.get() == '!');
+    check(fc.empty());
 }
 
 
+#ifdef SHN_THR
+class pipeproducer: public thread
+{
+    pipefifo& f;
+    integer count;
+public:
+    pipeproducer(pipefifo& _f, integer _count) throw(): f(_f), count(_count)  { }
+    ~pipeproducer() throw()  { }
+    void execute()
+    {
+        for (integer i = 0; i < count; i++)
+        {
+            if (f.is_char_fifo())
+                f.enq(str("0123456789abcdef").substr(i % 16));
+            else
+                f.var_enq(i % 10 ? variant(i) : variant(to_string(i)));
+        }
+        f.close();
+    }
+    void run()  { start(); }
+    void wait()  { join(); }
+};
+#endif
+
+
 static void test_fifos()
 {
 #ifdef DEBUG
@@ -587,8 +1021,225 @@ static void test_fifos()
     memfifo fc(NULL, true);
     test_bidir_char_fifo(fc);
 
+    {
+        // Bulk enqueue spanning several growing chunks, then a steady-state
+        // queue that reuses the spare chunk
+        memfifo fb(NULL, true);
+        str s;
+        for (int i = 0; i < 1000; i++)
+            s += "0123456789";
+        fb.enq(s);
+        fb.enq(s);
+        check(fb.deq(fifo::CHAR_ALL) == s + s);
+        check(fb.empty());
+        memfifo fv(NULL, false);
+        for (integer i = 0; i < 1000; i++)
+        {
+            fv.var_enq(i);
+            fv.var_enq(to_string(i));
+            variant v;
+            fv.var_deq(v);
+            check(v == (i % 2 ? variant(to_string(i / 2)) : variant(i / 2)));
+        }
+    }
+
     strfifo fs(NULL);
     test_bidir_char_fifo(fs);
+
+    int fd[2];
+    check(::pipe(fd) == 0);
+    ::fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    char buf[16];
+    {
+        stdfile so(-1, fd[1], stdfile::FULLY_BUFFERED);
+        so << "abc" << endl;
+        check(::read(fd[0], buf, sizeof(buf)) < 0);   // still buffered
+        so.flush();
+        check(::read(fd[0], buf, sizeof(buf)) == 4 && memcmp(buf, "abc\n", 4) == 0);
+        so.set_bufmode(stdfile::LINE_BUFFERED);
+        so << "de";
+        check(::read(fd[0], buf, sizeof(buf)) < 0);
+        so << 'f' << endl;
+        check(::read(fd[0], buf, sizeof(buf)) == 4 && memcmp(buf, "def\n", 4) == 0);
+        so << "ghi";
+    }
+    check(::read(fd[0], buf, sizeof(buf)) == 3);    // flushed by the destructor
+    ::close(fd[0]);
+    ::close(fd[1]);
+
+    {
+        varvec vec;
+        vec.push_back(integer(-1));
+        vec.push_back("abc");
+        vec.push_back(variant());
+        varset set;
+        set.push_back(integer(-1000));
+        set.push_back("xyz");
+        vardict dict;
+        dict.find_replace("key", vec);
+        dict.find_replace(integer(5), set);
+        ordset os(10, 20);
+        os.find_insert(255);
+        intset is(-70000, 70000);
+        is.find_insert(INTEGER_MAX);
+        is.find_insert(INTEGER_MIN);
+        variant vals[] = { variant(), integer(0), integer(INTEGER_MIN), integer(INTEGER_MAX),
+            str(), "abc", variant(1, 10), variant(10, 1), vec, set, dict, os, is };
+        const int count = int(sizeof(vals) / sizeof(vals[0]));
+
+        memfifo f(NULL, true);
+        for (int i = 0; i < count; i++)
+            f.bin_enq(vals[i]);
+        check(f.bin_skip());
+        for (int i = 1; i < count; i++)
+        {
+            variant v;
+            check(f.bin_deq(v));
+            check(v == vals[i]);
+        }
+        variant v;
+        check(!f.bin_deq(v));
+        check(!f.bin_skip());
+
+        // A truncated record
+        f.bin_enq(vec);
+        f.deq(5);
+        check_throw(f.bin_deq(v));
+
+        // Record lengths that disagree with the contents
+        {
+            strfifo b(NULL, "\x03\x01\x02\x02\x01\x02");
+            check_throw(b.bin_deq(v));
+            strfifo c(NULL, "\x01\x01\x02\x02\x01\x02");
+            check_throw(c.bin_deq(v));
+            strfifo d(NULL, "\x02\x01\x02\x02\x01\x04");
+            check(d.bin_skip() && d.bin_deq(v) && v == integer(2));
+        }
+
+        // Tags are fixed by the format
+        memfifo g(NULL, true);
+        g.bin_enq(dict);
+        check(g.deq(fifo::CHAR_ALL)[1] == 10);
+
+        // An element count of 2^63, negative as a memint
+        g << "\x0b\x06\x80\x80\x80\x80\x80\x80\x80\x80\x80\x01";
+        check_throw(g.bin_deq(v));
+
+        // A string length of 2^40 with no data: must not allocate it
+        {
+            strfifo b(NULL, str("\x04\x80\x80\x80\x80\x80\x20", 7));
+            check_throw(b.bin_read(v, NULL));
+        }
+
+        // Set elements out of order and duplicate
+        {
+            strfifo b(NULL, "\x07\x02\x01\x04\x01\x02");
+            check_throw(b.bin_read(v, NULL));
+            strfifo c(NULL, "\x07\x02\x01\x02\x01\x02");
+            check_throw(c.bin_read(v, NULL));
+            strfifo d(NULL, "\x07\x02\x01\x02\x01\x04");
+            d.bin_read(v, NULL);
+            check(v.as_set().size() == 2);
+        }
+
+        objptr<strfifo> s = new strfifo(NULL);
+        {
+            objptr<varoutfifo> o = new varoutfifo(NULL, s);
+            o->var_enq(vals[0]);
+            check(!s->all().empty());  // written on commit
+            for (int i = 1; i < count; i++)
+                o->var_enq(vals[i]);
+        }
+        objptr<varinfifo> in = new varinfifo(NULL, new strfifo(NULL, s->all()));
+        for (int i = 0; i < count; i++)
+        {
+            check(!in->empty());
+            in->var_deq(v);
+            check(v == vals[i]);
+        }
+        check(in->empty());
+    }
+
+#ifdef SHN_THR
+    {
+        pipefifo p(NULL, false, 100);
+        pipeproducer prod(p, 100000);
+        prod.run();
+        integer i = 0;
+        for (; !p.empty(); i++)
+        {
+            variant v;
+            p.var_deq(v);
+            check(v == (i % 10 ? variant(i) : variant(to_string(i))));
+        }
+        check(i == 100000);
+        prod.wait();
+    }
+    {
+        pipefifo p(NULL, true, 10);
+        pipeproducer prod(p, 10000);
+        prod.run();
+        memint total = 0;
+        while (!p.empty())
+        {
+            str s = p.deq(fifo::CHAR_SOME);
+            check(!s.empty());
+            total += s.size();
+        }
+        check(total == 10000 * 17 / 2);
+        prod.wait();
+    }
+    {
+        tempdir tmp;
+        str tmpPath = tmp.file("async.txt");
+        str line = "0123456789abcdefghijklmnopqrstuvwxyz\n";
+        {
+            outtext o(NULL, tmpPath);
+            o.set_async(2);
+            for (int i = 0; i < 10000; i++)
+                o << line;
+            o.sync();
+            check(o.tellp() == 10000 * line.size());
+            o << line;
+        }
+        intext i(NULL, tmpPath);
+        str all = i.deq(fifo::CHAR_ALL);
+        check(all.size() == 10001 * line.size());
+        check(all.substr(all.size() - line.size()) == line);
+        {
+            // A transfer in the middle of asynchronous output
+            str tmpPath2 = tmp.file("async2.txt");
+            outtext o(NULL, tmpPath2);
+            o.set_async(2);
+            o << "head\n";
+            memfifo m(NULL, true);
+            m << all;
+            check(m.xfer(o) == all.size());
+            intext src(NULL, tmpPath);
+            check(src.xfer(o) == all.size());
+            o << "tail\n";
+            check(o.tellp() == 10 + all.size() * 2);
+            o.sync();
+            intext i2(NULL, tmpPath2);
+            check(i2.deq(fifo::CHAR_ALL) == "head\n" + all + all + "tail\n");
+        }
+    }
+    if (::access("/dev/full", W_OK) == 0)
+    {
+        outtext o(NULL, "/dev/full");
+        o.set_async(3);
+        bool caught = false;
+        try
+        {
+            for (int i = 0; i < 10000; i++)
+                o << "0123456789abcdef";
+            o.sync();
+        }
+        catch (esyserr&)
+            { caught = true; }
+        check(caught);
+    }
+#endif
 }
 
 
@@ -633,10 +1284,319 @@ static void test_parser()
         f.deq(32);
         f.set_bufevent(NULL);
         check(rec.data == "careful with terms like readable"); // Yep!
+#ifdef DEBUG
+        intext f1(NULL, filePath);
+        str all = f1.deq(fifo::CHAR_ALL);
+        check(all.size() > 32);
+        intext::MMAP_MIN = 1;
+        intext f2(NULL, filePath);
+        f2.open();
+        check(f2.tellp() == all.size());  // mapped as a whole
+        check(f2.deq(11) == all.substr(0, 11));
+        check(f2.line() == all.substr(11, all.find('\n') - 11));
+        check(f2.deq(fifo::CHAR_ALL) == all.substr(all.find('\n') + 1));
+        check(f2.empty());
+        intext::MMAP_MIN = 64 * 1024;
+        {
+            // Copied by the kernel, then through the buffers after a partial read
+            tempdir tmp;
+            str tmpPath = tmp.file("xfer.txt");
+            {
+                intext i(NULL, filePath);
+                outtext o(NULL, tmpPath);
+                check(i.xfer(o) == all.size());
+                check(i.empty());
+                check(i.tellg() == all.size() && o.tellp() == all.size());
+            }
+            intext i(NULL, tmpPath);
+            check(i.deq(11) == all.substr(0, 11));
+            memfifo m(NULL, true);
+            check(i.xfer(m) == all.size() - 11);
+            check(m.deq(fifo::CHAR_ALL) == all.substr(11));
+        }
+        {
+            // Signs at the end of the 16-byte buffer and at eof
+            tempdir tmp;
+            str tmpPath = tmp.file("ints.txt");
+            {
+                outtext o(NULL, tmpPath);
+                o << str(15, ' ') << "-x" << str(13, ' ') << "-5 -";
+            }
+            intext i(NULL, tmpPath);
+            integer v;
+            bool o;
+            i.deq(15);
+            check(!i.deq_int(&v, &o) && i.get() == '-' && i.get() == 'x');
+            i.deq(13);
+            check(i.tellg() == 30);
+            check(i.deq_int(&v, &o) && !o && v == -5);
+            i.get();
+            check(!i.deq_int(&v, &o) && i.get() == '-' && i.empty());
+            check(i.tellg() == 34);
+        }
+#endif
+    }
+}
+
+
+static Module* load_cached(const str& filePath)
+{
+    Context context;
+    context.options.setDebugOpts(false);
+    context.options.moduleCache = true;
+    Module* m = context.loadModule(filePath);
+    context.execute();
+    return m;
+}
+
+
+static str compile_error(const char* filePath, bool lazyBodies)
+{
+    Context context;
+    context.options.setDebugOpts(false);
+    context.options.lazyBodies = lazyBodies;
+    try
+    {
+        context.loadModule(filePath);
+    }
+    catch (exception& e)
+    {
+        return e.what();
+    }
+    return "";
+}
+
+
+static void test_lazy_errors()
+{
+    // Deferred bodies report errors on the same lines as eagerly compiled ones
+    const char* filePath = TESTS_DIR "lazyerr.shn";
+    str expected = str(filePath) + "(6): 'undefinedthing' is unknown in this context";
+    check(compile_error(filePath, false) == expected);
+    check(compile_error(filePath, true) == expected);
+}
+
+
+static void test_modcache()
+{
+    tempdir tmp;
+    str tmpPath = tmp.file("modcache.shn");
+    {
+        outtext o(NULL, tmpPath);
+        o << "var x = 1\nassert x == 1\n";
+    }
+    Module* m1 = load_cached(tmpPath);
+    check(load_cached(tmpPath) == m1);
+    {
+        outtext o(NULL, tmpPath);
+        o << "var x = 21\nassert x == 21\n";
+    }
+    check(load_cached(tmpPath) != m1);
+    moduleCache.clear();
+}
+
+
+static void test_rerun()
+{
+    const char* mainPath = TESTS_DIR "rerunmain.shn";
+    const char* main2Path = TESTS_DIR "rerunmain2.shn";
+    {
+        Context context;
+        context.options.setDebugOpts(false);
+        context.options.modulePath.push_back(TESTS_DIR);
+        context.loadModule(mainPath);
+        // Objects in the used modules are restored along with the rest
+        for (int i = 0; i < 3; i++)
+            check(context.run(i).as_ord() == 111140 + i);
+        context.reset();
+        check(context.run(5).as_ord() == 111145);
+    }
+    {
+        Context context;
+        context.options.setDebugOpts(false);
+        context.options.modulePath.push_back(TESTS_DIR);
+        context.loadModule(main2Path);
+        check(context.run().as_ord() == 5);
+        // The previous main module becomes a used one, and the modules are
+        // initialized again
+        context.loadModule(mainPath);
+        for (int i = 0; i < 2; i++)
+            check(context.run(i).as_ord() == 111640 + i);
+    }
+}
+
+
+static variant run_image(const str& libDir, const str& imgPath, bool* loaded)
+{
+    Context context;
+    context.options.setDebugOpts(false);
+    context.options.modulePath.push_back(libDir);
+    const char* mainPath = TESTS_DIR "imagemain.shn";
+    context.loadModule(mainPath);
+    *loaded = context.loadImage(imgPath);
+    variant result = context.run();
+    check(context.run() == result);
+    if (!*loaded)
+        context.saveImage(imgPath);
+    return result;
+}
+
+
+static void test_image()
+{
+    // The used module is rewritten by the test, hence a temporary directory
+    tempdir tmp;
+    str libPath = tmp.file("imagelib.shn");
+    str imgPath = tmp.file("image.img");
+    {
+        outtext o(NULL, libPath);
+        o << "class point(int x, int y)\n{\n    var x\n    var y\n}\n"
+             "var dic1 = {'one' = 1, 'two' = 2}\n"
+             "var void words[str] = {'as', 'is'}\n"
+             "var origin = point(3, 4)\n"
+             "var pts = [origin, point(5, 6)]\n"
+             "var count = 0\n";
+    }
+    bool loaded;
+    check(run_image(tmp.path(), imgPath, &loaded) == 26321);
+    check(!loaded);
+    check(run_image(tmp.path(), imgPath, &loaded) == 26321);
+    check(loaded);
+    // Damaged images are ignored and replaced
+    str image = intext(NULL, imgPath).deq(fifo::CHAR_ALL);
+    memint sizes[] = { image.size() - 1, 3 };
+    for (int i = 0; i < 2; i++)
+    {
+        {
+            outtext o(NULL, imgPath);
+            o << image.substr(0, sizes[i]);
+        }
+        check(run_image(tmp.path(), imgPath, &loaded) == 26321);
+        check(!loaded);
+        check(intext(NULL, imgPath).deq(fifo::CHAR_ALL) == image);
+    }
+    // A flipped tag that still decodes: count = 0 read as an empty string
+    {
+        check(image[image.size() - 2] == 1 && image.back() == 0);
+        str damaged = image;
+        damaged.replace(damaged.size() - 2, char(4));
+        {
+            outtext o(NULL, imgPath);
+            o << damaged;
+        }
+        check(run_image(tmp.path(), imgPath, &loaded) == 26321);
+        check(!loaded);
+        check(intext(NULL, imgPath).deq(fifo::CHAR_ALL) == image);
+    }
+    // A string length of 2^40 in place of the length of 'one'
+    {
+        const char* p = (const char*)memmem(image.data(), image.size(), "\x04\x03one", 5);
+        check(p != NULL);
+        memint pos = p - image.data();
+        {
+            outtext o(NULL, imgPath);
+            o << image.substr(0, pos + 1) << str("\x80\x80\x80\x80\x80\x20", 6)
+              << image.substr(pos + 2);
+        }
+        check(run_image(tmp.path(), imgPath, &loaded) == 26321);
+        check(!loaded);
+        check(intext(NULL, imgPath).deq(fifo::CHAR_ALL) == image);
+    }
+    {
+        outtext o(NULL, libPath);
+        o << "var dic1 = {'two' = 3}\nvar void words[str] = {}\n"
+             "class point(int x, int y)\n{\n    var x\n    var y\n}\n"
+             "var origin = point(0, 0)\nvar pts = [origin, origin]\nvar count = 0\n";
+    }
+    check(run_image(tmp.path(), imgPath, &loaded) == 31);
+    check(!loaded);
+}
+
+
+#ifdef SHN_THR
+
+class ContextRunner: public object, protected thread
+{
+protected:
+    const char* filePath;
+    int runs;
+    void execute();
+public:
+    integer total;
+    str output;
+    bool failed;
+    ContextRunner(const char* f, int r) throw()
+        : filePath(f), runs(r), total(0), failed(false)  { start(); }
+    ~ContextRunner() throw()
+        { join(); }
+    void wait()
+        { join(); }
+};
+
+
+void ContextRunner::execute()
+{
+    try
+    {
+        Context context;
+        context.options.setDebugOpts(false);
+        context.options.moduleCache = true;
+        objptr<strfifo> out = new strfifo(NULL);
+        context.setStdStreams(out, out);
+        context.loadModule(filePath);
+        for (int i = 0; i < runs; i++)
+            total += context.run(integer(i)).as_ord();
+        output = out->all();
+    }
+    catch (exception&)
+    {
+        failed = true;
     }
 }
 
 
+static double now()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static void test_threads()
+{
+    // The same program is run by an increasing number of threads, each with
+    // its own context. The throughput is printed for information only: it
+    // depends on the machine and its load too much to be checked here.
+    const char* filePath = TESTS_DIR "threads.shn";
+    const int runs = 20;
+    int cores = int(sysconf(_SC_NPROCESSORS_ONLN));
+    for (int count = 1; count <= imax(2, imin(cores, 8)); count *= 2)
+    {
+        double start = now();
+        objvec<ContextRunner> runners;
+        for (int i = 0; i < count; i++)
+            runners.push_back((new ContextRunner(filePath, runs))->grab<ContextRunner>());
+        for (int i = 0; i < count; i++)
+        {
+            ContextRunner* r = runners[i];
+            r->wait();
+            check(!r->failed);
+            check(r->total == runs * 200010000LL + runs * (runs - 1) / 2);
+            str expect = "200010000\n";
+            check(r->output.size() == runs * expect.size());
+            check(r->output.substr(0, expect.size()) == expect);
+        }
+        runners.release_all();
+        double rate = count * runs / (now() - start);
+        sio << "threads: " << count << "  runs/s: " << integer(rate) << endl;
+    }
+    moduleCache.clear();
+}
+
+#endif
+
+
 void test_typesys()
 {
 /*
@@ -715,6 +1675,7 @@ int main()
         test_common();
         test_object();
         test_ordset();
+        test_intset();
         test_bytevec();
         test_string();
         test_strutils();
@@ -726,6 +1687,13 @@ int main()
         test_variant();
         test_fifos();
         test_parser();
+        test_lazy_errors();
+        test_modcache();
+        test_rerun();
+        test_image();
+#ifdef SHN_THR
+        test_threads();
+#endif
 //        test_typesys();
 //        test_codegen();
     }
@@ -12,8 +12,10 @@
 
 #ifdef XCODE
     const char* filePath = "../../src/tests/test.shn";
+    const char* modulePath = "../../src/tests";
 #else
     const char* filePath = "tests/test.shn";
+    const char* modulePath = "tests";
 #endif
 
 
@@ -34,6 +36,7 @@ int main()
         
         try
         {
+            context.options.modulePath.push_back(modulePath);
             // context.options.setDebugOpts(false);
             // context.options.compileOnly = true;
             context.loadModule(filePath);
@@ -67,6 +70,11 @@ int main()
                 exitcode = 104;
             }
         }
+
+#ifdef SHN_PROFILE
+        // Must be done while the modules and their types are still alive
+        allocprof::dump(serr);
+#endif
     }
 
     doneVm();
@@ -87,6 +87,7 @@ Keywords::kwinfo Keywords::keywords[] =
         {"switch", tokSwitch},
         {"this", tokThis},
         {"typeof", tokTypeOf},
+        {"uses", tokUses},
         {"var", tokVar},
         {"while", tokWhile},
         {"xor", tokXor},
@@ -124,7 +125,13 @@ void InputRecorder::clear()
 
 
 Parser::Parser(buffifo* inp)
-    : input(inp), linenum(1),
+    : input(inp), fileName(inp->get_name()), linenum(1),
+      prevIdent(), saveToken(tokUndefined),
+      token(tokUndefined), strValue(), intValue(0)  { }
+
+
+Parser::Parser(buffifo* inp, const str& fn, integer ln)
+    : input(inp), fileName(fn), linenum(ln),
       prevIdent(), saveToken(tokUndefined),
       token(tokUndefined), strValue(), intValue(0)  { }
 
@@ -156,6 +163,10 @@ const charset identRest = "0-9A-Za-z_";
 const charset digits = "0-9";
 const charset printableChars = "~20-~7E~81-~FE";
 const charset commentChars = printableChars + wsChars;
+// Initialized here rather than on first use for thread safety
+static const charset stringChars = printableChars - charset("'\\");
+static const charset hexDigits = "0-9A-Fa-f";
+static const charset skipChars = commentChars - '*';
 
 
 inline bool is_eol_char(char c)
@@ -176,8 +187,6 @@ void Parser::skipEol()
 
 void Parser::parseStringLiteral()
 {
-    static const charset stringChars = printableChars - charset("'\\");
-    static const charset hexDigits = "0-9A-Fa-f";
     strValue.clear();
     while (true)
     {
@@ -223,7 +232,6 @@ void Parser::parseStringLiteral()
 
 void Parser::skipMultilineComment()
 {
-    static const charset skipChars = commentChars - '*';
     while (true)
     {
         input->skip(skipChars);
@@ -298,8 +306,15 @@ restart:
         Token tok = keywords.find(strValue.c_str());
         if (tok != tokUndefined)
             return token = tok;
-        else
-            return token = tokIdent;
+        // Symbol tables compare interned names by pointer; the parser's own
+        // table is checked first so that the process-wide pool and its lock
+        // are only used once per distinct identifier
+        if (!atoms.find(strValue))
+        {
+            strPool.intern(strValue);
+            atoms.intern(strValue);
+        }
+        return token = tokIdent;
     }
 
     // --- Number ---
@@ -429,6 +444,39 @@ void Parser::skipMultiBlockEnd()
 }
 
 
+str Parser::skipMultiBlock()
+{
+    // Skips a {...} block without interpreting it and returns its source text
+    // including the curly brackets; the block starts on the current line.
+    assert(token == tokLCurly);
+    beginRecording();
+    int level = 0;
+    while (true)
+    {
+        next();
+        if (token == tokLCurly)
+            level++;
+        else if (token == tokRCurly && level-- == 0)
+            break;
+        else if (eof())
+            error("Unexpected end of file within a block");
+    }
+    // Line break in case the block ends with a single-line comment, unless
+    // the closing bracket is on a line of its own already, so that line
+    // numbers within the block are preserved
+    str result = "{";
+    result += endRecording();
+    memint i = result.size();
+    while (i > 0 && (result[i - 1] == ' ' || result[i - 1] == '\t'))
+        i--;
+    if (result[i - 1] != '\n')
+        result += '\n';
+    result += '}';
+    next();
+    return result;
+}
+
+
 str Parser::getIdentifier()
 {
     if (token != tokIdent)
@@ -439,6 +487,21 @@ str Parser::getIdentifier()
 }
 
 
+void Parser::usesClauses(strvec& modNames)
+{
+    // 'uses' clauses can only appear at the beginning of a module, which
+    // allows to discover module dependencies without compiling them
+    while (skipIf(tokUses))
+    {
+        do
+            modNames.push_back(getIdentifier());
+        while (skipIf(tokComma));
+        skipEos();
+        skipWsSeps();
+    }
+}
+
+
 void Parser::expect(Token tok, const char* errName)
 {
     if (token != tok)
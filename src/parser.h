@@ -15,7 +15,7 @@ enum Token
     tokDump, tokAssert, tokBegin, tokIf, tokElif, tokElse, tokDefault,
     tokWhile, tokBreak, tokContinue, tokSwitch, tokCase, tokReturn, tokExit,
     tokFor,
-    tokTypeOf, tokDel, tokIns, tokThis,
+    tokTypeOf, tokDel, tokIns, tokThis, tokUses,
 
     // Term level
     tokMul, tokDiv, tokMod,
@@ -73,12 +73,14 @@ class Parser: noncopyable
 {
 protected:
     objptr<buffifo> input;
+    str fileName;
     integer linenum;
 
     str prevIdent; // undoIdent()
     Token saveToken;
 
     InputRecorder recorder;  // raw input recorder, for assert and dump
+    strpool atoms;           // identifiers seen by this parser, already in strPool
 
     str errorLocation() const;
     void parseStringLiteral();
@@ -93,6 +95,7 @@ public:
     uinteger intValue;
 
     Parser(buffifo*);
+    Parser(buffifo*, const str& fileName, integer linenum); // a fragment of a file
     ~Parser();
 
     Token next();
@@ -118,14 +121,17 @@ public:
             { if (token >= tokMin && token <= tokMax) { next(); return true; } return false; }
     void skipMultiBlockBegin(const char* errmsg);
     void skipMultiBlockEnd();
+    str skipMultiBlock();   // returns the source of the block
     bool isBlockEnd()
             { return token == tokRCurly; }
     str getIdentifier();
+    void usesClauses(strvec& modNames);
 
-    str getFileName() const { return input->get_name(); }
+    str getFileName() const { return fileName; }
     integer getLineNum() const;
     void beginRecording();
     str endRecording();
+    bool isRecording()      { return recorder.active(); }
 };
 
 
@@ -5,10 +5,12 @@
 #ifdef DEBUG
 int memfifo::CHUNK_SIZE = 32 * _varsize;
 int intext::BUF_SIZE = 4096 * int(sizeof(integer));
+int intext::MMAP_MIN = 64 * 1024;
 #endif
 
 
 charset non_eol_chars = ~charset("\r\n");
+static charscan non_eol_scan(non_eol_chars);  // for next_line()
 
 
 fifo::fifo(Type* rt, bool is_char) throw()
@@ -24,16 +26,31 @@ void fifo::_wronly_err()                { throw efifo("FIFO is write-only"); }
 void fifo::_rdonly_err()                { throw efifo("FIFO is read-only"); }
 void fifo::_fifo_type_err()             { fatal(0x2001, "FIFO type mismatch"); }
 void fifo::_token_err()                 { throw efifo("Token too long"); }
+void fifo::_bin_err()                   { throw efifo("Invalid binary data"); }
 const char* fifo::get_tail()            { _wronly_err(); return NULL; }
 const char* fifo::get_tail(memint*)     { _wronly_err(); return NULL; }
 void fifo::deq_bytes(memint)            { _wronly_err(); }
 variant* fifo::enq_var()                { _rdonly_err(); return NULL; }
+void fifo::commit_var()                 { }
 void fifo::enq_char(char)               { _rdonly_err(); }
 memint fifo::enq_chars(const char*, memint) { _rdonly_err(); return 0; }
+int fifo::get_infd()                    { return -1; }
+int fifo::get_outfd()                   { return -1; }
+void fifo::infd_read(memint)            { }
+void fifo::outfd_written(memint)        { }
+memfifo* fifo::get_memfifo()            { return NULL; }
 bool fifo::empty() const                { _rdonly_err(); return true; }
 void fifo::flush()                      { }
 
 
+int fifo::peek_next()
+{
+    memint avail;
+    const char* p = get_tail(&avail);
+    return p != NULL && avail > 1 ? uchar(p[1]) : -1;
+}
+
+
 void fifo::_req_non_empty() const
 {
     if (empty())
@@ -163,7 +180,10 @@ void fifo::var_enq(const variant& v)
             variant::_type_err();
     }
     else
+    {
         ::new(enq_var()) variant(v);
+        commit_var();
+    }
 }
 #endif
 
@@ -192,8 +212,12 @@ str fifo::deq(memint count)
 
 void fifo::_token(const charset& chars, str* result)
 {
+    // Most tokens are short and are scanned with a plain bit test; the lookup
+    // table is only set up once the token turns out to be long
     _req(true);
     memint total = 0;
+    charscan scan;
+    bool useScan = false;
     while (1)
     {
         memint avail;
@@ -201,9 +225,17 @@ void fifo::_token(const charset& chars, str* result)
         if (b == NULL)
             break;
         const char* p = b;
-        const char* e = b + avail;
-        while (p < e && chars[*p])
-            p++;
+        if (!useScan)
+        {
+            p = chars.span(b, b + imin<memint>(avail, charscan::MIN_SPAN));
+            if (p - b == charscan::MIN_SPAN)
+            {
+                scan.assign(chars);
+                useScan = true;
+            }
+        }
+        if (useScan)
+            p = scan.span(p, b + avail);
         memint count = p - b;
         if (count == 0)
             break;
@@ -225,22 +257,813 @@ void fifo::_token(const charset& chars, str* result)
 str fifo::line()
 {
     str result;
-    _token(non_eol_chars, &result);
-    skip_eol();
+    next_line(result);
     return result;
 }
 
 
+bool fifo::next_line(str& result)
+{
+    // Lines are scanned a word at a time; a line that ends within the
+    // buffer is copied in one go, reusing the string's buffer if possible
+    _req(true);
+    memint total = 0;
+    for (bool first = true; ; first = false)
+    {
+        memint avail;
+        const char* p = get_tail(&avail);
+        if (p == NULL)
+        {
+            if (first)
+            {
+                result.clear();
+                return false;
+            }
+            break;
+        }
+        memint count = non_eol_scan.span(p, p + avail) - p;
+        if (max_token > 0 && total + count > max_token)
+            _token_err();
+        if (first)
+            result.reassign(p, count);
+        else
+            result.append(p, count);
+        total += count;
+        deq_bytes(count);
+        if (count < avail)
+            break;
+    }
+    skip_eol();
+    return true;
+}
+
+
 void fifo::enq(const char* s)   { if (s != NULL) enq(s, strlen(s)); }
 void fifo::enq(const str& s)    { enq_chars(s.data(), s.size()); }
-void fifo::enq(large i)         { enq(to_string(i)); }
+
+
+void fifo::enq(large i)
+{
+    char buf[65];
+    int len;
+    const char* p = _itobase(i, buf, 10, len, true);
+    enq_chars(p, len);
+}
+
+
+fifo& fifo::fmt(large value, int width, char fill, int base)
+{
+    _req(true);
+    if (base < 2 || base > 64)
+        throw emessage("Invalid base");
+    char buf[65];
+    int len;
+    const char* p = _itobase(value, buf, base, len, true);
+    bool left = width < 0;
+    memint pad = (left ? -memint(width) : memint(width)) - len;
+    if (pad > 0 && !left)
+    {
+        if (fill == '0' && *p == '-')
+        {
+            enq_char('-');
+            p++;
+            len--;
+        }
+        _enq_fill(fill, pad);
+    }
+    enq_chars(p, len);
+    if (pad > 0 && left)
+        _enq_fill(fill, pad);
+    return *this;
+}
+
+
+static inline int _digitval(uchar c, int base)
+{
+    int d;
+    if (c >= '0' && c <= '9')
+        d = c - '0';
+    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+        d = (c | 0x20) - 'a' + 10;
+    else
+        return -1;
+    return d < base ? d : -1;
+}
+
+
+bool fifo::deq_int(integer* result, bool* overflow, int base)
+{
+    _req(true);
+    if (base < 2 || base > 36)
+        throw emessage("Invalid base");
+    *overflow = false;
+    memint avail;
+    const char* p = get_tail(&avail);
+    if (p == NULL)
+        return false;
+    bool neg = false;
+    if (*p == '-' || *p == '+')
+    {
+        // The sign is consumed only if a digit follows, which may be
+        // in the next buffer
+        int next = avail > 1 ? uchar(p[1]) : peek_next();
+        if (next < 0 || _digitval(char(next), base) < 0)
+            return false;
+        neg = *p == '-';
+        deq_bytes(1);
+    }
+
+    // The limit is checked without a division per digit, same as in strtol()
+    const ularge lim = ularge(INTEGER_MAX) + 1;
+    const ularge cutoff = lim / base;
+    const int cutlim = int(lim % base);
+    ularge value = 0;
+    memint digits = 0;
+    while ((p = get_tail(&avail)) != NULL)
+    {
+        const char* b = p;
+        const char* e = p + avail;
+        for (; p < e; p++)
+        {
+            int d = _digitval(*p, base);
+            if (d < 0)
+                break;
+            if (value > cutoff || (value == cutoff && d > cutlim))
+                *overflow = true;
+            else
+                value = value * base + d;
+        }
+        if (p > b)
+        {
+            digits += p - b;
+            deq_bytes(p - b);
+        }
+        if (p < e)
+            break;
+    }
+    if (digits == 0)
+        return false;
+    if (!neg && value == lim)
+        *overflow = true;
+    *result = *overflow ? 0 : neg ? integer(0 - value) : integer(value);
+    return true;
+}
+
+
+memint fifo::deq_ints(podvec<integer>& result, memint count, const charset& seps, int base)
+{
+    memint done = 0;
+    for (; done < count; done++)
+    {
+        eat(seps);
+        integer value;
+        bool overflow;
+        if (!deq_int(&value, &overflow, base))
+            break;
+        if (overflow)
+            throw efifo("Numeric overflow");
+        result.push_back(value);
+    }
+    return done;
+}
+
+
+void fifo::_enq_fill(char c, memint count)
+{
+    char buf[64];
+    memset(buf, c, imin<memint>(count, sizeof(buf)));
+    while (count > 0)
+    {
+        memint n = imin<memint>(count, sizeof(buf));
+        enq_chars(buf, n);
+        count -= n;
+    }
+}
 
 
 void fifo::enq(const varvec& v)
 {
     _req(false);
     for (memint i = 0; i < v.size() - 1; i++)
+    {
         new(enq_var()) variant(v[i]);
+        commit_var();
+    }
+}
+
+
+// --- binary serialization ------------------------------------------------ //
+
+
+// A record is the length of the encoded value followed by the value, which
+// is a tag byte (BIN_xxx below) and then:
+//   VOID:          nothing
+//   ORD:           zigzag varint
+//   STR:           varint length, bytes
+//   RANGE:         left and right as zigzag varints; empty range is 0, -1
+//   VEC, SET:      varint count, values
+//   ORDSET:        varint count, bytes
+//   INTSET:        varint count, the first value as zigzag varint followed
+//                  by varint deltas
+//   DICT:          varint count, key/value pairs
+// Varints are little-endian base-128 numbers.
+
+// The tags are part of the format and don't follow variant::Type
+enum
+{
+    BIN_VOID = 0, BIN_ORD = 1, BIN_STR = 4, BIN_RANGE = 5, BIN_VEC = 6,
+    BIN_SET = 7, BIN_ORDSET = 8, BIN_INTSET = 9, BIN_DICT = 10, BIN_RTOBJ = 12
+};
+
+
+static uinteger _zigzag(integer v)
+    { return (uinteger(v) << 1) ^ uinteger(v >> (sizeof(integer) * 8 - 1)); }
+
+static integer _unzigzag(uinteger u)
+    { return integer(u >> 1) ^ -integer(u & 1); }
+
+
+static memint _uintsize(uinteger u)
+{
+    memint n = 1;
+    for (; u >= 0x80; u >>= 7)
+        n++;
+    return n;
+}
+
+
+static memint _binsize(const variant& v)
+{
+    memint n = 1;
+    switch (v.getType())
+    {
+    case variant::VOID:
+        break;
+    case variant::ORD:
+        n += _uintsize(_zigzag(v._int()));
+        break;
+    case variant::STR:
+        n += _uintsize(v._str().size()) + v._str().size();
+        break;
+    case variant::RANGE:
+        {
+            const range& r = v._range();
+            if (r.empty())
+                n += 2;
+            else
+                n += _uintsize(_zigzag(r.left())) + _uintsize(_zigzag(r.right()));
+        }
+        break;
+    case variant::VEC:
+    case variant::SET:
+        {
+            const varvec& a = v.is(variant::VEC) ? v._vec() : v._set();
+            n += _uintsize(a.size());
+            for (memint i = 0; i < a.size(); i++)
+                n += _binsize(a[i]);
+        }
+        break;
+    case variant::ORDSET:
+        {
+            const charset& c = v._ordset().get_charset();
+            memint count = 0;
+            for (int b = c.next(0); b >= 0; b = c.next(b + 1))
+                count++;
+            n += _uintsize(count) + count;
+        }
+        break;
+    case variant::INTSET:
+        {
+            const intset& s = v._intset();
+            n += _uintsize(s.size());
+            intset::cursor c;
+            integer prev = 0;
+            for (memint i = 0; i < s.size(); i++)
+            {
+                integer k = s.at(i, c);
+                n += _uintsize(i == 0 ? _zigzag(k) : uinteger(k) - uinteger(prev));
+                prev = k;
+            }
+        }
+        break;
+    case variant::DICT:
+        {
+            const vardict& d = v._dict();
+            n += _uintsize(d.size());
+            for (memint i = 0; i < d.size(); i++)
+                n += _binsize(d.key(i)) + _binsize(d.value(i));
+        }
+        break;
+    default:
+        throw efifo("Value can't be serialized");
+    }
+    return n;
+}
+
+
+void fifo::_enq_uint(uinteger u)
+{
+    char buf[sizeof(uinteger) * 8 / 7 + 1];
+    memint n = 0;
+    for (; u >= 0x80; u >>= 7)
+        buf[n++] = char(u | 0x80);
+    buf[n++] = char(u);
+    enq_chars(buf, n);
+}
+
+
+uchar fifo::_deq_byte()
+{
+    const char* p = get_tail();
+    if (p == NULL)
+        _bin_err();
+    uchar c = *p;
+    deq_bytes(1);
+    return c;
+}
+
+
+uinteger fifo::_deq_uint()
+{
+    uinteger u = 0;
+    for (unsigned shift = 0; ; shift += 7)
+    {
+        if (shift >= sizeof(uinteger) * 8)
+            _bin_err();
+        uchar c = _deq_byte();
+        u |= uinteger(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+            return u;
+    }
+}
+
+
+memint fifo::_deq_count(memint max)
+{
+    // Element counts are checked before anything is allocated for them
+    uinteger n = _deq_uint();
+    if (n > uinteger(max))
+        _bin_err();
+    return memint(n);
+}
+
+
+void fifo::_skip_raw(memint count)
+{
+    while (count > 0)
+    {
+        memint avail;
+        if (get_tail(&avail) == NULL)
+            _bin_err();
+        if (avail > count)
+            avail = count;
+        deq_bytes(avail);
+        count -= avail;
+    }
+}
+
+
+void fifo::_bin_enq(const variant& v, bincodec* codec)
+{
+    switch (v.getType())
+    {
+    case variant::VOID:
+        enq_char(BIN_VOID);
+        break;
+    case variant::ORD:
+        enq_char(BIN_ORD);
+        _enq_uint(_zigzag(v._int()));
+        break;
+    case variant::STR:
+        enq_char(BIN_STR);
+        _enq_uint(v._str().size());
+        enq(v._str());
+        break;
+    case variant::RANGE:
+        {
+            const range& r = v._range();
+            enq_char(BIN_RANGE);
+            _enq_uint(_zigzag(r.empty() ? 0 : r.left()));
+            _enq_uint(_zigzag(r.empty() ? -1 : r.right()));
+        }
+        break;
+    case variant::VEC:
+    case variant::SET:
+        {
+            const varvec& a = v.is(variant::VEC) ? v._vec() : v._set();
+            enq_char(v.is(variant::VEC) ? BIN_VEC : BIN_SET);
+            _enq_uint(a.size());
+            for (memint i = 0; i < a.size(); i++)
+                _bin_enq(a[i], codec);
+        }
+        break;
+    case variant::ORDSET:
+        {
+            const charset& c = v._ordset().get_charset();
+            memint count = 0;
+            for (int b = c.next(0); b >= 0; b = c.next(b + 1))
+                count++;
+            enq_char(BIN_ORDSET);
+            _enq_uint(count);
+            for (int b = c.next(0); b >= 0; b = c.next(b + 1))
+                enq_char(char(b));
+        }
+        break;
+    case variant::INTSET:
+        {
+            const intset& s = v._intset();
+            enq_char(BIN_INTSET);
+            _enq_uint(s.size());
+            intset::cursor c;
+            integer prev = 0;
+            for (memint i = 0; i < s.size(); i++)
+            {
+                integer k = s.at(i, c);
+                _enq_uint(i == 0 ? _zigzag(k) : uinteger(k) - uinteger(prev));
+                prev = k;
+            }
+        }
+        break;
+    case variant::DICT:
+        {
+            const vardict& d = v._dict();
+            enq_char(BIN_DICT);
+            _enq_uint(d.size());
+            for (memint i = 0; i < d.size(); i++)
+            {
+                _bin_enq(d.key(i), codec);
+                _bin_enq(d.value(i), codec);
+            }
+        }
+        break;
+    case variant::RTOBJ:
+        if (codec == NULL)
+            throw efifo("Value can't be serialized");
+        enq_char(BIN_RTOBJ);
+        codec->enq_obj(*this, v);
+        break;
+    default:
+        throw efifo("Value can't be serialized");
+    }
+}
+
+
+void fifo::_bin_deq(variant& v, bincodec* codec)
+{
+    int t = _deq_byte();
+    switch (t)
+    {
+    case BIN_VOID:
+        v.clear();
+        break;
+    case BIN_ORD:
+        v = integer(_unzigzag(_deq_uint()));
+        break;
+    case BIN_STR:
+        {
+            // The declared length is not trusted: the string grows only as
+            // the data arrives, so that a damaged length runs into the end
+            // of data rather than into a huge allocation
+            memint n = _deq_count(MEMINT_MAX / 2);
+            str s;
+            while (n > 0)
+            {
+                memint avail;
+                const char* b = get_tail(&avail);
+                if (b == NULL)
+                    _bin_err();
+                if (avail > n)
+                    avail = n;
+                s.append(b, avail);
+                deq_bytes(avail);
+                n -= avail;
+            }
+            v = s;
+        }
+        break;
+    case BIN_RANGE:
+        {
+            integer l = _unzigzag(_deq_uint());
+            integer r = _unzigzag(_deq_uint());
+            v = range(l, r);
+        }
+        break;
+    case BIN_VEC:
+        {
+            memint n = _deq_count(MEMINT_MAX / memint(sizeof(variant)));
+            varvec a;
+            for (memint i = 0; i < n; i++)
+            {
+                variant x;
+                _bin_deq(x, codec);
+                a.push_back(x);
+            }
+            v = a;
+        }
+        break;
+    case BIN_SET:
+        {
+            // Sets are stored sorted, therefore can be restored by appending,
+            // unless there are objects, which are ordered by their addresses;
+            // elements out of order mean the data is damaged
+            memint n = _deq_count(MEMINT_MAX / memint(sizeof(variant)));
+            varset a;
+            for (memint i = 0; i < n; i++)
+            {
+                variant x;
+                _bin_deq(x, codec);
+                if (codec != NULL)
+                    a.find_insert(x);
+                else if (a.empty() || a.back().compare(x) < 0)
+                    a.push_back(x);
+                else
+                    _bin_err();
+            }
+            v = a;
+        }
+        break;
+    case BIN_ORDSET:
+        {
+            memint n = _deq_count(256);
+            ordset s;
+            for (memint i = 0; i < n; i++)
+                s.find_insert(_deq_byte());
+            v = s;
+        }
+        break;
+    case BIN_INTSET:
+        {
+            memint n = _deq_count(MEMINT_MAX);
+            intset s;
+            uinteger x = 0;
+            for (memint i = 0; i < n; i++)
+            {
+                uinteger d = _deq_uint();
+                x = i == 0 ? uinteger(_unzigzag(d)) : x + d;
+                s.find_insert(integer(x));
+            }
+            v = s;
+        }
+        break;
+    case BIN_DICT:
+        {
+            memint n = _deq_count(MEMINT_MAX / memint(sizeof(variant) * 2));
+            vardict d;
+            for (memint i = 0; i < n; i++)
+            {
+                variant key, value;
+                _bin_deq(key, codec);
+                _bin_deq(value, codec);
+                d.find_replace(key, value);
+            }
+            v = d;
+        }
+        break;
+    case BIN_RTOBJ:
+        if (codec == NULL)
+            _bin_err();
+        codec->deq_obj(*this, v);
+        break;
+    default:
+        _bin_err();
+    }
+}
+
+
+void fifo::bin_enq(const variant& v)
+{
+    _req(true);
+    _enq_uint(_binsize(v));
+    _bin_enq(v);
+}
+
+
+bool fifo::bin_deq(variant& v)
+{
+    _req(true);
+    if (empty())
+        return false;
+    // bin_enq() writes the shortest encoding, so the decoded value should
+    // take exactly the declared length, otherwise bin_skip() on the same
+    // data would go out of step
+    uinteger size = _deq_uint();
+    _bin_deq(v);
+    if (uinteger(_binsize(v)) != size)
+        _bin_err();
+    return true;
+}
+
+
+void fifo::bin_write(const variant& v, bincodec* codec)
+{
+    _req(true);
+    _bin_enq(v, codec);
+}
+
+
+void fifo::bin_read(variant& v, bincodec* codec)
+{
+    _req(true);
+    _bin_deq(v, codec);
+}
+
+
+bool fifo::bin_skip()
+{
+    _req(true);
+    if (empty())
+        return false;
+    _skip_raw(memint(_deq_uint()));
+    return true;
+}
+
+
+// --- fifo transfer ------------------------------------------------------- //
+
+
+// Copies everything from ifd to ofd in the kernel: sendfile() works when the
+// source is a regular file, splice() when either side is a pipe. Returns
+// false if neither is supported for the given pair of descriptors. The
+// number of bytes copied is kept in total, also if an error is thrown.
+static bool kernelcopy(int ifd, int ofd, memint& total, const str& dest_name)
+{
+    total = 0;
+#ifdef __linux__
+    const size_t XFER_MAX = 1 << 30;
+    bool use_splice = false;
+    while (true)
+    {
+        ssize_t ret = use_splice ?
+            ::splice(ifd, NULL, ofd, NULL, XFER_MAX, SPLICE_F_MOVE)
+            : ::sendfile(ofd, ifd, NULL, XFER_MAX);
+        if (ret > 0)
+            total += ret;
+        else if (ret == 0)
+            return true;
+        else if (errno == EINTR)
+            continue;
+        else if (total == 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            if (use_splice)
+                return false;
+            use_splice = true;
+        }
+        else
+            throw esyserr(errno, dest_name);
+    }
+#else
+    (void)ifd; (void)ofd; (void)dest_name;
+    return false;
+#endif
+}
+
+
+memint fifo::xfer(fifo& dest)
+{
+    _req(true);
+    dest._req(true);
+    if (&dest == this)
+        return 0;
+
+    memfifo* src = get_memfifo();
+    memfifo* dst = dest.get_memfifo();
+    if (src != NULL && dst != NULL)
+    {
+        memint total = dst->take(*src);
+        if (total >= 0)
+            return total;
+    }
+
+    int ofd = dest.get_outfd();
+    if (ofd >= 0)
+    {
+        int ifd = get_infd();
+        if (ifd >= 0)
+        {
+            memint total = 0;
+            bool done = false;
+            try
+                { done = kernelcopy(ifd, ofd, total, dest.get_name()); }
+            catch (exception&)
+            {
+                // Keep the positions right for what has been copied so far
+                infd_read(total);
+                dest.outfd_written(total);
+                throw;
+            }
+            if (done)
+            {
+                infd_read(total);
+                dest.outfd_written(total);
+                return total;
+            }
+        }
+    }
+
+    // Generic: the source's buffers are passed to the destination directly
+    memint total = 0;
+    while (!empty())
+    {
+        memint count;
+        const char* p = get_tail(&count);
+        dest.enq_chars(p, count);
+        deq_bytes(count);
+        total += count;
+    }
+    return total;
+}
+
+
+// --- varinfifo, varoutfifo ----------------------------------------------- //
+
+
+varinfifo::varinfifo(Type* rt, fifo* s) throw()
+    : fifo(rt, false), source(s), loaded(false)  { }
+
+
+varinfifo::~varinfifo() throw()
+{
+    if (loaded)
+        ((variant*)&slot)->~variant();
+}
+
+
+str varinfifo::get_name() const
+    { return source->get_name(); }
+
+
+bool varinfifo::empty() const
+{
+    if (!loaded)
+    {
+        variant* v = ::new((void*)&slot) variant();
+        if (source->bin_deq(*v))
+            ((varinfifo*)this)->loaded = true;
+        else
+            v->~variant();
+    }
+    return !loaded;
+}
+
+
+const char* varinfifo::get_tail()
+    { return empty() ? NULL : (const char*)&slot; }
+
+
+const char* varinfifo::get_tail(memint* count)
+{
+    if (empty())
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = _varsize;
+    return (const char*)&slot;
+}
+
+
+void varinfifo::deq_bytes(memint count)
+{
+    // The variant has been moved or destroyed by the caller
+    assert(loaded && count == _varsize);
+    (void)count;
+    loaded = false;
+}
+
+
+varoutfifo::varoutfifo(Type* rt, fifo* d) throw()
+    : fifo(rt, false), dest(d), pending(false)  { }
+
+
+varoutfifo::~varoutfifo() throw()
+{
+    if (pending)
+        ((variant*)&slot)->~variant();
+}
+
+
+str varoutfifo::get_name() const
+    { return dest->get_name(); }
+
+
+variant* varoutfifo::enq_var()
+{
+    _req(false);
+    if (pending)    // never committed
+        ((variant*)&slot)->~variant();
+    pending = true;
+    return (variant*)&slot;
+}
+
+
+void varoutfifo::commit_var()
+{
+    // The variant is written as soon as it's complete; the destination
+    // isn't flushed, buffifo-based fifos make room in the buffer themselves
+    variant v;
+    *(podvar*)&v = slot;    // takes over the value, in case bin_enq() throws
+    pending = false;
+    dest->bin_enq(v);
 }
 
 
@@ -248,14 +1071,21 @@ void fifo::enq(const varvec& v)
 
 
 memfifo::memfifo(Type* rt, bool ch) throw()
-    : fifo(rt, ch), head(NULL), tail(NULL), head_offs(0), tail_offs(0)  { }
+    : fifo(rt, ch), head(NULL), tail(NULL), spare(NULL), head_offs(0), tail_offs(0)  { }
+
+
+memfifo::~memfifo() throw()
+{
+    try { clear(); } catch(exception&) { }
+    delete spare;
+}
 
 
-memfifo::~memfifo() throw()             { try { clear(); } catch(exception&) { } }
 inline const char* memfifo::get_tail()  { return tail ? (tail->data + tail_offs) : NULL; }
 inline bool memfifo::empty() const      { return tail == NULL; }
 inline variant* memfifo::enq_var()      { _req(false); return (variant*)enq_space(_varsize); }
 str memfifo::get_name() const           { return "<memfifo>"; }
+memfifo* memfifo::get_memfifo()         { return this; }
 
 
 void memfifo::clear()
@@ -266,7 +1096,7 @@ void memfifo::clear()
         while (tail != NULL)
         {
 #ifdef DEBUG
-            head_offs = tail_offs = CHUNK_SIZE;
+            head_offs = tail_offs = tail->size;
 #endif
             deq_chunk();
         }
@@ -286,7 +1116,12 @@ void memfifo::deq_chunk()
 {
     assert(tail != NULL && head != NULL);
     chunk* c = tail;
+    int size = c->size;
     tail = tail->next;
+    // Keep the bigger one of the two for reuse
+    c->next = NULL;
+    if (spare == NULL || spare->size <= size)
+        c = exchange(spare, c);
     delete c;
     if (tail == NULL)
     {
@@ -296,97 +1131,367 @@ void memfifo::deq_chunk()
     }
     else
     {
-        assert(tail_offs == CHUNK_SIZE);
+        assert(tail_offs == size);
         tail_offs = 0;
     }
 }
 
 
-void memfifo::enq_chunk()
+void memfifo::enq_chunk(memint hint)
+{
+    // The size grows geometrically while there is data in the fifo; `hint'
+    // is how much the caller is about to write
+    memint size = CHUNK_SIZE;
+    if (head != NULL)
+        size = imin<memint>(memint(head->size) * 2, CHUNK_SIZE * MAX_CHUNK_FACTOR);
+    if (hint > size)
+        size = imin<memint>(hint, CHUNK_SIZE * MAX_CHUNK_FACTOR);
+    chunk* c;
+    if (spare != NULL && spare->size >= size)
+        c = exchange(spare, (chunk*)NULL);
+    else
+        c = new(size) chunk(int(size));
+    if (head == NULL)
+    {
+        assert(tail == NULL && head_offs == 0);
+        head = tail = c;
+    }
+    else
+    {
+        assert(head_offs == head->size);
+        head->next = c;
+        head = c;
+        head_offs = 0;
+    }
+}
+
+
+memint memfifo::take(memfifo& src)
+{
+    // Only an empty fifo can take over the chunks as they are: all chunks but
+    // the last one should be full and only the first one may have an offset
+    if (!empty() || src.empty())
+        return -1;
+    memint total = 0;
+    for (chunk* c = src.tail; c != NULL; c = c->next)
+        total += (c == src.head ? src.head_offs : c->size) - (c == src.tail ? src.tail_offs : 0);
+    head = exchange(src.head, (chunk*)NULL);
+    tail = exchange(src.tail, (chunk*)NULL);
+    head_offs = exchange(src.head_offs, 0);
+    tail_offs = exchange(src.tail_offs, 0);
+    return total;
+}
+
+
+const char* memfifo::get_tail(memint* count)
+{
+    if (tail == NULL)
+    {
+        *count = 0;
+        return NULL;
+    }
+    if (tail == head)
+        *count = head_offs - tail_offs;
+    else
+        *count = tail->size - tail_offs;
+    assert(*count <= tail->size);
+    return tail->data + tail_offs;
+}
+
+
+void memfifo::deq_bytes(memint count)
+{
+    assert(tail != NULL && (tail_offs + count) <= ((tail == head) ? head_offs : tail->size));
+    tail_offs += int(count);
+    if (tail_offs == ((tail == head) ? head_offs : tail->size))
+        deq_chunk();
+}
+
+
+int memfifo::peek_next()
+{
+    memint avail;
+    const char* p = get_tail(&avail);
+    if (p == NULL)
+        return -1;
+    if (avail > 1)
+        return uchar(p[1]);
+    // Chunks past the tail are never empty
+    return tail != head ? uchar(tail->next->data[0]) : -1;
+}
+
+
+memint memfifo::enq_avail()
+{
+    if (head == NULL || head_offs == head->size)
+        return CHUNK_SIZE;
+    return head->size - head_offs;
+}
+
+
+char* memfifo::enq_space(memint count)
+{
+    if (head == NULL || head_offs == head->size)
+        enq_chunk(count);
+    assert(count <= head->size - head_offs);
+    char* result = head->data + head_offs;
+    head_offs += int(count);
+    return result;
+}
+
+
+void memfifo::enq_char(char c)
+{
+    _req(true);
+    *enq_space(1) = c;
+}
+
+
+memint memfifo::enq_chars(const char* p, memint count)
+{
+    _req(true);
+    memint save_count = count;
+    while (count > 0)
+    {
+        // Fill the current chunk, then allocate the next one big enough for
+        // the rest of the data (within the limit) and fill it in one go
+        if (head == NULL || head_offs == head->size)
+            enq_chunk(count);
+        memint avail = imin<memint>(count, head->size - head_offs);
+        memcpy(head->data + head_offs, p, avail);
+        head_offs += int(avail);
+        count -= avail;
+        p += avail;
+    }
+    return save_count;
+}
+
+
+// --- pipefifo ------------------------------------------------------------ //
+
+
+#ifdef SHN_THR
+
+pipefifo::pipefifo(Type* rt, bool ch, memint cap) throw()
+    : fifo(rt, ch), capacity(cap * (ch ? 1 : _varsize)), elemsize(ch ? 1 : _varsize),
+      head(NULL), head_offs(0), spare(NULL), tail(NULL), tail_offs(0),
+      count(0), recycled(NULL), closed(false), waiting(0)
+{
+    assert(capacity >= elemsize);
+    head = tail = new_chunk();
+}
+
+
+pipefifo::~pipefifo() throw()
+{
+    if (!is_char_fifo())
+    {
+        while (get_count() > 0)
+        {
+            ((variant*)get_tail())->~variant();
+            deq_bytes(_varsize);
+        }
+    }
+    chunk* lists[3] = { tail, spare, recycled };
+    for (int i = 0; i < 3; i++)
+        while (lists[i] != NULL)
+            pmemfree(exchange(lists[i], lists[i]->next));
+}
+
+
+str pipefifo::get_name() const  { return "<pipefifo>"; }
+
+
+pipefifo::chunk* pipefifo::new_chunk()
+{
+    // Producer: take the chunks recycled by the consumer all at once
+    if (spare == NULL)
+        spare = __atomic_exchange_n(&recycled, (chunk*)NULL, __ATOMIC_ACQUIRE);
+    chunk* c = spare;
+    if (c != NULL)
+        spare = c->next;
+    else
+        c = (chunk*)pmemalloc(sizeof(chunk));
+    c->next = NULL;
+    return c;
+}
+
+
+bool pipefifo::ready(int who, memint need) const
+{
+    if (who == CONSUMER)
+        return get_count() >= need || __atomic_load_n(&closed, __ATOMIC_ACQUIRE);
+    else
+        return get_count() + elemsize <= capacity;
+}
+
+
+void pipefifo::wait_for(int who, memint need)
+{
+    for (int i = 0; i < SPIN_COUNT; i++)
+    {
+        if (ready(who, need))
+            return;
+    }
+    scopelock lock(mtx);
+    __atomic_or_fetch(&waiting, who, __ATOMIC_SEQ_CST);
+    while (!ready(who, need))
+        cond.wait(mtx);
+    __atomic_and_fetch(&waiting, ~who, __ATOMIC_SEQ_CST);
+}
+
+
+void pipefifo::wake_up(int who)
+{
+    // Pairs with setting the flag in wait_for(): either the other side sees
+    // the new state before going to sleep, or we see its flag
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST) & who)
+    {
+        scopelock lock(mtx);
+        cond.broadcast();
+    }
+}
+
+
+bool pipefifo::empty() const
+{
+    if (get_count() == 0)
+        ((pipefifo*)this)->wait_for(CONSUMER);
+    return get_count() == 0;
+}
+
+
+const char* pipefifo::get_tail(memint* avail)
 {
-    chunk* c = new chunk();
-    if (head == NULL)
+    if (empty())
     {
-        assert(tail == NULL && head_offs == 0);
-        head = tail = c;
+        *avail = 0;
+        return NULL;
     }
-    else
+    if (tail_offs == CHUNK_SIZE)
     {
-        assert(head_offs == CHUNK_SIZE);
-        head->next = c;
-        head = c;
-        head_offs = 0;
+        // The producer has moved on to the next chunk, so this one is free
+        chunk* c = tail;
+        tail = tail->next;
+        tail_offs = 0;
+        c->next = __atomic_load_n(&recycled, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&recycled, &c->next, c, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
     }
+    *avail = imin<memint>(get_count(), CHUNK_SIZE - tail_offs);
+    return tail->data + tail_offs;
 }
 
 
-const char* memfifo::get_tail(memint* count)
+const char* pipefifo::get_tail()
+    { memint avail; return get_tail(&avail); }
+
+
+void pipefifo::deq_bytes(memint n)
 {
-    if (tail == NULL)
-    {
-        *count = 0;
-        return NULL;
-    }
-    if (tail == head)
-        *count = head_offs - tail_offs;
-    else
-        *count = CHUNK_SIZE - tail_offs;
-    assert(*count <= CHUNK_SIZE);
-    return tail->data + tail_offs;
+    assert(n <= get_count() && tail_offs + n <= CHUNK_SIZE);
+    tail_offs += n;
+    __atomic_sub_fetch(&count, n, __ATOMIC_RELEASE);
+    wake_up(PRODUCER);
 }
 
 
-void memfifo::deq_bytes(memint count)
+int pipefifo::peek_next()
 {
-    assert(tail != NULL && (tail_offs + count) <= ((tail == head) ? head_offs : CHUNK_SIZE));
-    tail_offs += int(count);
-    if (tail_offs == ((tail == head) ? head_offs : CHUNK_SIZE))
-        deq_chunk();
+    memint avail;
+    const char* p = get_tail(&avail);
+    if (p == NULL)
+        return -1;
+    if (avail > 1)
+        return uchar(p[1]);
+    // Wait for one more char unless the pipe can't hold two
+    if (capacity < 2)
+        return -1;
+    wait_for(CONSUMER, 2);
+    if (get_count() < 2)
+        return -1;
+    if (tail_offs + 1 < CHUNK_SIZE)
+        return uchar(tail->data[tail_offs + 1]);
+    return uchar(tail->next->data[0]);
 }
 
 
-memint memfifo::enq_avail()
+char* pipefifo::enq_space(memint n)
 {
-    if (head == NULL || head_offs == CHUNK_SIZE)
-        return CHUNK_SIZE;
-    return CHUNK_SIZE - head_offs;
+    assert(n <= CHUNK_SIZE);
+    if (closed)
+        _full_err();
+    if (get_count() + n > capacity)
+        wait_for(PRODUCER);
+    if (head_offs + n > CHUNK_SIZE)
+    {
+        assert(head_offs == CHUNK_SIZE);
+        // The link must be visible before any bytes in the new chunk
+        chunk* c = new_chunk();
+        head->next = c;
+        head = c;
+        head_offs = 0;
+    }
+    return head->data + head_offs;
 }
 
 
-char* memfifo::enq_space(memint count)
+void pipefifo::commit(memint n)
 {
-    if (head == NULL || head_offs == CHUNK_SIZE)
-        enq_chunk();
-    assert(count <= CHUNK_SIZE - head_offs);
-    char* result = head->data + head_offs;
-    head_offs += int(count);
-    return result;
+    head_offs += n;
+    __atomic_add_fetch(&count, n, __ATOMIC_RELEASE);
+    wake_up(CONSUMER);
 }
 
 
-void memfifo::enq_char(char c)
+variant* pipefifo::enq_var()
+{
+    _req(false);
+    return (variant*)enq_space(_varsize);
+}
+
+
+void pipefifo::commit_var()
+    { commit(_varsize); }
+
+
+void pipefifo::enq_char(char c)
 {
     _req(true);
     *enq_space(1) = c;
+    commit(1);
 }
 
 
-memint memfifo::enq_chars(const char* p, memint count)
+memint pipefifo::enq_chars(const char* p, memint n)
 {
     _req(true);
-    memint save_count = count;
-    while (count > 0)
+    memint save_n = n;
+    while (n > 0)
     {
-        memint avail = enq_avail();
-        if (count < avail)
-            avail = count;
-        memcpy(enq_space(avail), p, avail);
-        count -= avail;
-        p += avail;
+        char* d = enq_space(1);
+        memint k = imin(imin(n, CHUNK_SIZE - head_offs), capacity - get_count());
+        if (k < 1)
+            k = 1;
+        memcpy(d, p, k);
+        commit(k);
+        p += k;
+        n -= k;
     }
-    return save_count;
+    return save_n;
+}
+
+
+void pipefifo::close()
+{
+    __atomic_store_n(&closed, true, __ATOMIC_RELEASE);
+    wake_up(CONSUMER);
 }
 
+#endif
+
 
 // --- buffifo ------------------------------------------------------------- //
 
@@ -575,9 +1680,18 @@ str strfifo::all() const
 
 
 intext::intext(Type* rt, const str& fn) throw()
-    : buffifo(rt, true), file_name(fn), _fd(-1), _eof(false)  { }
+    : buffifo(rt, true), file_name(fn), _fd(-1), _eof(false), _map(NULL), _mapsize(0)  { }
+
+
+intext::~intext() throw()
+{
+    if (_map != NULL)
+        ::munmap(_map, _mapsize);
+    if (_fd > 2)
+        ::close(_fd);
+}
+
 
-intext::~intext() throw()       { if (_fd > 2) ::close(_fd); }
 void intext::error(int code)    { _eof = true; throw esyserr(code, file_name); }
 str intext::get_name() const    { return file_name; }
 
@@ -591,8 +1705,37 @@ void intext::doopen()
 }
 
 
+void intext::domap()
+{
+    // Large regular files are mapped as a whole, so that get_tail() returns
+    // all the remaining data and tokens are extracted without refilling the
+    // buffer; pipes, devices and mapping failures fall back to read()
+    struct stat st;
+    if (::fstat(_fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || st.st_size < intext::MMAP_MIN || ularge(st.st_size) > ularge(MEMINT_MAX))
+        return;
+    void* p = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (p == MAP_FAILED)
+        return;
+#ifdef MADV_SEQUENTIAL
+    ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+#endif
+    call_bufevent();
+    _map = (char*)p;
+    _mapsize = st.st_size;
+    buffer = _map;
+    bufsize = bufhead = _mapsize;
+    call_bufevent();
+}
+
+
 void intext::doread()
 {
+    if (_map != NULL)
+    {
+        _eof = true;    // the whole file has been in the buffer
+        return;
+    }
     call_bufevent();
     filebuf.resize(intext::BUF_SIZE);
     buffer = (char*)filebuf.data();
@@ -607,18 +1750,58 @@ void intext::doread()
 }
 
 
+int intext::peek_next()
+{
+    memint avail;
+    const char* p = get_tail(&avail);
+    if (p == NULL)
+        return -1;
+    if (avail > 1)
+        return uchar(p[1]);
+    if (_map != NULL)
+        return -1;
+    // Move the last char to the beginning of the buffer and read more after it
+    char c = *p;
+    call_bufevent();
+    filebuf.resize(intext::BUF_SIZE);
+    buffer = (char*)filebuf.data();
+    buffer[0] = c;
+    memint result = ::read(_fd, buffer + 1, intext::BUF_SIZE - 1);
+    if (result < 0)
+        error(errno);
+    buforig += buftail;
+    buftail = 0;
+    bufsize = bufhead = result + 1;
+    call_bufevent();
+    return result > 0 ? uchar(buffer[1]) : -1;
+}
+
+
 bool intext::empty() const
 {
     if (_eof)
         return true;
     if (_fd < 0)
+    {
         ((intext*)this)->doopen();
+        ((intext*)this)->domap();
+    }
     if (buftail == bufhead)
         ((intext*)this)->doread();
     return _eof;
 }
 
 
+int intext::get_infd()
+{
+    if (_eof)
+        return -1;
+    if (_fd < 0)
+        doopen();
+    return (_map == NULL && buftail == bufhead) ? _fd : -1;
+}
+
+
 // --- outtext -------------------------------------------------------------- //
 
 
@@ -634,14 +1817,50 @@ outtext::outtext(Type* rt, const str& fn) throw()
 outtext::~outtext() throw()
 {
     try
-        { flush(); }
+        { sync(); }
     catch (exception&)
         { }
+#ifdef SHN_THR
+    _writer.clear();
+#endif
     if (_fd > 2)
         ::close(_fd);
 }
 
 
+void outtext::sync()
+{
+    flush();
+#ifdef SHN_THR
+    if (!_writer.empty())
+    {
+        // Back to synchronous mode
+        int code = _writer->finish();
+        _writer.clear();
+        buffer = (char*)filebuf.data();
+        bufhead = 0;
+        if (code != 0)
+            error(code);
+    }
+#endif
+}
+
+
+void outtext::set_async(int buffers)
+{
+    sync();
+#ifdef SHN_THR
+    if (buffers > 1 && !_err)
+    {
+        _writer = new outwriter(outtext::BUF_SIZE, buffers);
+        buffer = _writer->get_free();
+    }
+#else
+    (void)buffers;
+#endif
+}
+
+
 void outtext::error(int code)
     { _err = true; throw esyserr(code, file_name); }
 
@@ -650,6 +1869,35 @@ str outtext::get_name() const
     { return file_name; }
 
 
+void outtext::doopen()
+{
+    _fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if (_fd < 0)
+        error(errno);
+}
+
+
+int outtext::get_outfd()
+{
+    // Whatever is buffered should reach the file before the descriptor is
+    // written to directly; asynchronous writing stays on
+    flush();
+#ifdef SHN_THR
+    if (!_writer.empty())
+    {
+        int code = _writer->drain();
+        if (code != 0)
+            error(code);
+    }
+#endif
+    if (_err)
+        return -1;
+    if (_fd < 0)
+        doopen();
+    return _fd;
+}
+
+
 void outtext::flush()
 {
     if (_err)
@@ -657,11 +1905,18 @@ void outtext::flush()
     if (bufhead > 0)
     {
         if (_fd < 0)
+            doopen();
+#ifdef SHN_THR
+        if (!_writer.empty())
         {
-            _fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
-            if (_fd < 0)
-                error(errno);
+            int code = _writer->put(_fd, buffer, bufhead, &buffer);
+            buforig += bufhead;
+            bufhead = 0;
+            if (code != 0)
+                error(code);
+            return;
         }
+#endif
         memint ret = ::write(_fd, buffer, bufhead);
         if (ret < 0)
             error(errno);
@@ -671,31 +1926,252 @@ void outtext::flush()
 }
 
 
+// --- outwriter ----------------------------------------------------------- //
+
+
+#ifdef SHN_THR
+
+outwriter::outwriter(memint bufsize, int c) throw()
+    : fd(-1), count(c), bufs(NULL), freebufs(NULL), nfree(0), qbufs(NULL),
+      qsizes(NULL), qhead(0), queued(0), pending(0), stopping(false), err(0)
+{
+    bufs = (char**)pmemalloc(count * sizeof(char*));
+    freebufs = (char**)pmemalloc(count * sizeof(char*));
+    qbufs = (char**)pmemalloc(count * sizeof(char*));
+    qsizes = (memint*)pmemalloc(count * sizeof(memint));
+    for (int i = 0; i < count; i++)
+        freebufs[nfree++] = bufs[i] = (char*)pmemalloc(bufsize);
+    start();
+}
+
+
+outwriter::~outwriter() throw()
+{
+    finish();
+    for (int i = 0; i < count; i++)
+        pmemfree(bufs[i]);
+    pmemfree(qsizes);
+    pmemfree(qbufs);
+    pmemfree(freebufs);
+    pmemfree(bufs);
+}
+
+
+char* outwriter::get_free()
+{
+    scopelock lock(mtx);
+    assert(nfree > 0);
+    return freebufs[--nfree];
+}
+
+
+int outwriter::put(int f, char* buf, memint size, char** next)
+{
+    scopelock lock(mtx);
+    fd = f;
+    int i = (qhead + queued) % count;
+    qbufs[i] = buf;
+    qsizes[i] = size;
+    queued++;
+    pending++;
+    cond.broadcast();
+    while (nfree == 0)
+        cond.wait(mtx);
+    *next = freebufs[--nfree];
+    return exchange(err, 0);
+}
+
+
+int outwriter::drain()
+{
+    scopelock lock(mtx);
+    while (pending > 0)
+        cond.wait(mtx);
+    return exchange(err, 0);
+}
+
+
+int outwriter::finish()
+{
+    int code = drain();
+    {
+        scopelock lock(mtx);
+        stopping = true;
+        cond.broadcast();
+    }
+    join();
+    return code;
+}
+
+
+void outwriter::execute()
+{
+    scopelock lock(mtx);
+    while (1)
+    {
+        while (queued == 0 && !stopping)
+            cond.wait(mtx);
+        if (queued == 0)
+            break;
+        char* buf = qbufs[qhead];
+        const char* p = buf;
+        memint size = qsizes[qhead];
+        qhead = (qhead + 1) % count;
+        queued--;
+        bool skip = err != 0;  // discard the remaining data after an error
+        int code = 0;
+        mtx.leave();
+        while (!skip && size > 0)
+        {
+            memint ret = ::write(fd, p, size);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                { code = errno; break; }
+            p += ret;
+            size -= ret;
+        }
+        mtx.enter();
+        if (code != 0 && err == 0)
+            err = code;
+        freebufs[nfree++] = buf;
+        pending--;
+        cond.broadcast();
+    }
+}
+
+#endif
+
+
 // --- stdfile ------------------------------------------------------------- //
 
 
-stdfile::stdfile(int infd, int outfd) throw()
-    : intext(NULL, "<stdio>"), _ofd(outfd)
+stdfile::stdfile(int infd, int outfd, BufMode m) throw()
+    : intext(NULL, "<stdio>"), _ofd(outfd), _omode(UNBUFFERED), _obuf(NULL), _ohead(0)
 {
     _fd = infd;
     if (infd == -1)
         _eof = true;
+    set_bufmode(m);
     _mkstatic();
 }
 
+
 stdfile::~stdfile() throw()
-    { }
+{
+    try
+        { flush(); }
+    catch (exception&)
+        { }
+    pmemfree(_obuf);
+#ifdef DEBUG
+    pincrement(&object::allocated);  // undo _mkstatic() in the constructor
+#endif
+}
+
+
+void stdfile::set_bufmode(BufMode m)
+{
+    flush();
+    if (m == AUTO_BUFFERED)
+        m = ::isatty(_ofd) ? LINE_BUFFERED : FULLY_BUFFERED;
+    _omode = m;
+    if (_omode != UNBUFFERED && _obuf == NULL)
+        _obuf = (char*)pmemalloc(OBUF_SIZE);
+}
+
+
+void stdfile::dowrite(const char* p, memint count)
+{
+    while (count > 0)
+    {
+        memint ret = ::write(_ofd, p, count);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            _full_err();
+        p += ret;
+        count -= ret;
+    }
+}
+
+
+void stdfile::flush()
+{
+    if (_ohead > 0)
+    {
+        memint count = exchange<memint>(_ohead, 0);
+        dowrite(_obuf, count);
+    }
+}
+
+
+int stdfile::get_outfd()
+{
+    flush();
+    return _ofd;
+}
+
+
+bool stdfile::empty() const
+{
+    // Make sure the prompt is visible before blocking on input
+    if (buftail == bufhead && !_eof)
+        ((stdfile*)this)->flush();
+    return intext::empty();
+}
+
 
 void stdfile::enq_char(char c)
-    { if (::write(_ofd, &c, 1) < 1) _full_err(); }
+{
+    if (_omode == UNBUFFERED)
+        dowrite(&c, 1);
+    else
+    {
+        if (_ohead == OBUF_SIZE)
+            flush();
+        _obuf[_ohead++] = c;
+        if (c == '\n' && _omode == LINE_BUFFERED)
+            flush();
+    }
+}
+
 
 memint stdfile::enq_chars(const char* p, memint count)
-    { return ::write(_ofd, p, count); }
+{
+    if (_omode == UNBUFFERED || count >= OBUF_SIZE)
+    {
+        flush();
+        dowrite(p, count);
+    }
+    else
+    {
+        if (count > OBUF_SIZE - _ohead)
+            flush();
+        memcpy(_obuf + _ohead, p, count);
+        _ohead += count;
+        if (_omode == LINE_BUFFERED && memchr(p, '\n', count) != NULL)
+            flush();
+    }
+    return count;
+}
 
 
+stdfile sio(STDIN_FILENO, STDOUT_FILENO, stdfile::AUTO_BUFFERED);
+stdfile serr(-1, STDERR_FILENO, stdfile::LINE_BUFFERED);
 
-stdfile sio(STDIN_FILENO, STDOUT_FILENO);
-stdfile serr(-1, STDERR_FILENO);
+
+void flushStdFiles()
+{
+    try
+        { sio.flush(); }
+    catch (exception&)
+        { }
+    try
+        { serr.flush(); }
+    catch (exception&)
+        { }
+}
 
 
 // --- System utilities ---------------------------------------------------- //
@@ -726,3 +2202,28 @@ static FileType getFileType(const char* path)
 bool isFile(const char* path)
     { return getFileType(path) == FT_FILE; }
 
+
+str canonicalPath(const str& path)
+{
+    char buf[PATH_MAX];
+    str p = path;
+    if (realpath(p.c_str(), buf) == NULL)
+        return path;
+    return buf;
+}
+
+
+bool getFileStamp(const char* path, large* mtime, large* size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+#ifdef __APPLE__
+    *mtime = large(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    *mtime = large(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    *size = st.st_size;
+    return true;
+}
+
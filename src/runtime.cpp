@@ -130,6 +130,47 @@ void charset::invert()
 }
 
 
+int charset::next(int b) const
+{
+    // Empty words are skipped as a whole; within a word the byte is located
+    // first, so that the result doesn't depend on the machine byte order
+    if (b < 0)
+        b = 0;
+    if (b >= BITS)
+        return -1;
+    int i = b / 8;
+    uchar bits = data[i] & lbitmask[b % 8];
+    while (bits == 0)
+    {
+        if (++i >= BYTES)
+            return -1;
+        if (i % sizeof(word) == 0)
+            while (((word*)data)[i / sizeof(word)] == 0)
+                if ((i += sizeof(word)) >= BYTES)
+                    return -1;
+        bits = data[i];
+    }
+    return i * 8 + lowbit(bits);
+}
+
+
+const char* charset::span(const char* p, const char* e) const
+{
+    while (p < e && contains(*p))
+        p++;
+    return p;
+}
+
+
+uinteger charset::hash() const
+{
+    uinteger h = 0;
+    for (int i = 0; i < WORDS; i++)
+        h = _hashmix(h, ((word*)data)[i]);
+    return h;
+}
+
+
 bool charset::le(const charset& s) const 
 {
     for (int i = 0; i < WORDS; i++) 
@@ -143,6 +184,61 @@ bool charset::le(const charset& s) const
 }
 
 
+// --- charscan ------------------------------------------------------------ //
+
+
+void charscan::assign(const charset& s) throw()
+{
+    const word ones = word(-1) / 255;
+    stopCount = 0;
+    for (int i = 0; i < charset::BITS; i++)
+    {
+        members[i] = s.contains(i);
+        if (!members[i] && stopCount++ < STOPS)
+            stops[stopCount - 1] = ones * word(i);
+    }
+}
+
+
+const char* charscan::span(const char* p, const char* e) const
+{
+    if (stopCount <= STOPS)
+    {
+        // Look for any of the excluded characters in all bytes of a word
+        // simultaneously
+        const word ones = word(-1) / 255;
+        const word highs = ones << 7;
+        while (e - p >= memint(sizeof(word)))
+        {
+            word w, found = 0;
+            memcpy(&w, p, sizeof(word));
+            for (int k = 0; k < stopCount; k++)
+            {
+                word x = w ^ stops[k];
+                found |= (x - ones) & ~x & highs;
+            }
+            if (found)
+                break;
+            p += sizeof(word);
+        }
+    }
+    else
+    {
+        // Eight lookups are combined before a single branch
+        const uchar* u = (const uchar*)p;
+        while (e - p >= 8 && (members[u[0]] & members[u[1]] & members[u[2]] & members[u[3]]
+                & members[u[4]] & members[u[5]] & members[u[6]] & members[u[7]]))
+        {
+            p += 8;
+            u += 8;
+        }
+    }
+    while (p < e && members[uchar(*p)])
+        p++;
+    return p;
+}
+
+
 // --- object -------------------------------------------------------------- //
 
 
@@ -190,6 +286,7 @@ void* object::operator new(size_t self)
 #ifdef DEBUG
     pincrement(&object::allocated);
 #endif
+    PROF_ALLOC(self);
     return p;
 }
 
@@ -201,6 +298,7 @@ void* object::operator new(size_t self, memint extra)
 #ifdef DEBUG
     pincrement(&object::allocated);
 #endif
+    PROF_ALLOC(self + extra);
     return p;
 }
 
@@ -223,16 +321,18 @@ object* object::_dup(size_t self, memint extra)
 #ifdef DEBUG
     pincrement(&object::allocated);
 #endif    
+    PROF_ALLOC(self + extra);
     memcpy(o, this, self);
     o->_refcount = 0;
     return o;
 }
 
 
-object* object::reallocate(object* p, size_t self, memint extra)
+object* object::reallocate(object* p, size_t self, memint oldextra, memint extra)
 {
     assert(p->_refcount == 1);
     assert(self > 0 && extra >= 0);
+    PROF_REALLOC(extra - oldextra);
     return (object*)::pmemrealloc(p, self + extra);
 }
 
@@ -241,6 +341,148 @@ rtobject::~rtobject() throw()
     { }
 
 
+// --- allocprof ----------------------------------------------------------- //
+
+
+#ifdef SHN_PROFILE
+
+// Profile sites are kept in a plain open-addressing hash table outside of
+// the object heap, so that the profiler itself is never profiled.
+
+struct profsite
+{
+    Type* type;
+    integer line;
+    large allocs;
+    large reallocs;
+    large bytes;
+};
+
+
+Type* allocprof::curType = NULL;
+integer allocprof::curLine = 0;
+
+static profsite* profSites = NULL;
+static memint profCapacity = 0;  // always a power of 2
+static memint profCount = 0;
+static bool profPaused = false;
+
+
+static memint profHash(Type* t, integer l)
+    { return memint((umemint(t) >> 4) * 31 + umemint(l)); }
+
+
+static profsite* profLookup(profsite* sites, memint cap, Type* t, integer l)
+{
+    memint i = profHash(t, l) & (cap - 1);
+    while (sites[i].allocs || sites[i].reallocs)
+    {
+        if (sites[i].type == t && sites[i].line == l)
+            return sites + i;
+        i = (i + 1) & (cap - 1);
+    }
+    sites[i].type = t;
+    sites[i].line = l;
+    return sites + i;
+}
+
+
+static profsite* profSite()
+{
+    if (profCount * 2 >= profCapacity)
+    {
+        memint newcap = profCapacity ? profCapacity * 2 : 256;
+        profsite* newsites = (profsite*)::pmemcalloc(newcap * sizeof(profsite));
+        for (memint i = 0; i < profCapacity; i++)
+            if (profSites[i].allocs || profSites[i].reallocs)
+                *profLookup(newsites, newcap, profSites[i].type, profSites[i].line) = profSites[i];
+        ::pmemfree(profSites);
+        profSites = newsites;
+        profCapacity = newcap;
+    }
+    profsite* s = profLookup(profSites, profCapacity, allocprof::curType, allocprof::curLine);
+    if (!s->allocs && !s->reallocs)
+        profCount++;
+    return s;
+}
+
+
+void allocprof::alloc(memint bytes)
+{
+    if (profPaused)
+        return;
+    profsite* s = profSite();
+    s->allocs++;
+    s->bytes += bytes;
+}
+
+
+void allocprof::realloc(memint delta)
+{
+    if (profPaused)
+        return;
+    profsite* s = profSite();
+    s->reallocs++;
+    s->bytes += delta;
+}
+
+
+static int profCompare(const void* a, const void* b)
+{
+    large x = ((profsite*)a)->bytes, y = ((profsite*)b)->bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+
+void allocprof::dump(fifo& stm)
+{
+    // Sites refer to Type objects, so this should be called before the
+    // modules are freed
+    profPaused = true;
+    profsite* sorted = (profsite*)::pmemalloc(imax<memint>(profCount, 1) * sizeof(profsite));
+    memint count = 0;
+    large totalAllocs = 0, totalBytes = 0;
+    for (memint i = 0; i < profCapacity; i++)
+        if (profSites[i].allocs || profSites[i].reallocs)
+        {
+            sorted[count++] = profSites[i];
+            totalAllocs += profSites[i].allocs;
+            totalBytes += profSites[i].bytes;
+        }
+    qsort(sorted, count, sizeof(profsite), profCompare);
+    stm << "# Allocation profile: " << totalAllocs << " allocs, " << totalBytes << " bytes" << endl;
+    stm << "#      bytes     allocs   reallocs  site" << endl;
+    for (memint i = 0; i < count; i++)
+    {
+        profsite& s = sorted[i];
+        stm << to_string(s.bytes, 10, 12, ' ') << ' ' << to_string(s.allocs, 10, 10, ' ')
+            << ' ' << to_string(s.reallocs, 10, 10, ' ') << "  ";
+        if (s.type == NULL)
+            stm << "<runtime>";
+        else if (s.type->isAnyState())
+            ((State*)s.type)->fqName(stm);
+        else
+            s.type->dumpDef(stm);
+        if (s.line)
+            stm << " (" << s.line << ')';
+        stm << endl;
+    }
+    ::pmemfree(sorted);
+    profPaused = false;
+}
+
+
+void allocprof::clear()
+{
+    ::pmemfree(profSites);
+    profSites = NULL;
+    profCapacity = 0;
+    profCount = 0;
+}
+
+#endif
+
+
 // --- container ----------------------------------------------------------- //
 
 
@@ -299,11 +541,13 @@ container* container::reallocate(container* p, memint newsize)
     assert(p);
     assert(p->isunique());
     assert(newsize > p->_capacity || newsize < p->_size);
+    memint oldcap = p->_capacity;
     p->_capacity = newsize > p->_capacity ? _calc_prealloc(newsize) : newsize;
     if (p->_capacity <= 0)
         overflow();
     p->_size = newsize;
-    return (container*)object::reallocate(p, sizeof(*p), p->_capacity);
+    p->_hash = 0;
+    return (container*)object::reallocate(p, sizeof(*p), oldcap, p->_capacity);
 }
 
 
@@ -314,6 +558,7 @@ container* container::_dup(memint cap, memint siz)
     container* c = (container*)object::_dup(sizeof(container), cap);
     c->_capacity = cap;
     c->_size = siz;
+    c->_hash = 0;
     return c;
 }
 
@@ -346,8 +591,9 @@ void bytevec::_init(memint len, char fill) throw()
 
 void bytevec::_init(const char* buf, memint len) throw()
 {
+    char* p = _init(len);  // also for len == 0, e.g. called from assign()
     if (len)
-        ::memcpy(_init(len), buf, len);
+        ::memcpy(p, buf, len);
 }
 
 
@@ -377,15 +623,25 @@ void bytevec::assign(const char* buf, memint len)
     { obj._fin(); _init(buf, len); }
 
 
+void bytevec::reassign(const char* buf, memint len)
+{
+    if (len > 0 && !empty() && _isunique() && len <= capacity())
+    {
+        obj->set_size(len);
+        obj->touch();
+        ::memcpy(obj->data(), buf, len);
+    }
+    else
+        assign(buf, len);
+}
+
+
 void bytevec::clear()
 {
+    // Non-POD elements are finalized by the container's destructor once the
+    // last reference is gone; the container may be shared with other vectors.
     if (!empty())
-    {
-        // finalize() is not needed for POD data, but we put it here so that clear() works
-        // for descendant non-POD containers. Same applies to insert()/append().
-        obj->finalize(obj->data(), obj->size());
         obj.clear();
-    }
 }
 
 
@@ -649,7 +905,7 @@ memint str::compare(const char* s, memint blen) const
 {
     memint alen = size();
     memint len = imin(alen, blen);
-    if (len == 0)
+    if (len == 0 || s == data())  // same storage, e.g. interned strings
         return alen - blen;
     int result = ::memcmp(data(), s, len);
     if (result == 0)
@@ -659,6 +915,25 @@ memint str::compare(const char* s, memint blen) const
 }
 
 
+uinteger str::hash() const
+{
+    if (empty())
+        return 0;
+    uinteger h = obj->hash();
+    if (h == 0)
+    {
+        // FNV-1a
+        h = 2166136261u;
+        for (const char* p = begin(); p < end(); p++)
+            h = (h ^ uchar(*p)) * 16777619u;
+        if (h == 0)
+            h = 1;
+        obj->set_hash(h);
+    }
+    return h;
+}
+
+
 bool str::operator== (const char* s) const
     { return compare(s, pstrlen(s)) == 0; }
 
@@ -702,7 +977,14 @@ str str::substr(memint pos) const
 // --- string utilities ---------------------------------------------------- //
 
 
-static const char* _itobase(large value, char* buf, int base, int& len, bool _signed)
+// Pairs of decimal digits "00".."99" for the two-digits-per-step conversion
+static const char _decpairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+
+const char* _itobase(large value, char* buf, int base, int& len, bool _signed)
 {
     // internal conversion routine: converts the value to a string 
     // at the end of the buffer and returns a pointer to the first
@@ -727,26 +1009,48 @@ static const char* _itobase(large value, char* buf, int base, int& len, bool _si
     ularge v = value;
     if (_signed && base == 10 && value < 0)
     {
-        v = -value;
-        // since we can't handle the lowest signed value, we just return a built-in string.
-        if (large(v) < 0)   // a minimum value negated results in the same value
-        {
-            if (sizeof(value) == 8)
-            {
-                len = 20;
-                return "-9223372036854775808";
-            }
-            else
-                abort();
-        }
+        v = ularge(0) - v;  // also correct for the minimum value
         neg = true;
     }
 
-    do
+    if (base == 10)
+    {
+        // Two digits per division
+        while (v >= 100)
+        {
+            unsigned r = unsigned(v % 100);
+            v /= 100;
+            i -= 2;
+            buf[i] = _decpairs[r * 2];
+            buf[i + 1] = _decpairs[r * 2 + 1];
+        }
+        if (v >= 10)
+        {
+            i -= 2;
+            buf[i] = _decpairs[v * 2];
+            buf[i + 1] = _decpairs[v * 2 + 1];
+        }
+        else
+            buf[--i] = char('0' + v);
+    }
+    else if ((base & (base - 1)) == 0)
     {
-        buf[--i] = pdigits[unsigned(v % base)];
-        v /= base;
-    } while (v > 0);
+        // Powers of 2: shifts instead of divisions
+        int shift = lowbit(base);
+        do
+        {
+            buf[--i] = pdigits[unsigned(v & (base - 1))];
+            v >>= shift;
+        } while (v > 0);
+    }
+    else
+    {
+        do
+        {
+            buf[--i] = pdigits[unsigned(v % base)];
+            v /= base;
+        } while (v > 0);
+    }
 
     if (neg)
         buf[--i] = '-';
@@ -944,6 +1248,118 @@ str to_displayable(const str& s)
 }
 
 
+// --- strpool ------------------------------------------------------------- //
+
+
+strpool strPool;
+
+
+strpool::strpool() throw()
+    : slots(NULL), capacity(0), count(0)  { }
+
+
+strpool::~strpool() throw()
+    { clear(); }
+
+
+memint strpool::lookup(const str& s) const
+{
+    memint mask = capacity - 1;
+    memint i = s.hash() & mask;
+    while (!slots[i].empty() && slots[i] != s)
+        i = (i + 1) & mask;
+    return i;
+}
+
+
+void strpool::rehash(memint newcap)
+{
+    str* old = slots;
+    memint oldcap = capacity;
+    capacity = newcap;
+    slots = (str*)pmemcalloc(capacity * sizeof(str));  // all-zero is an empty str
+    for (memint i = 0; i < oldcap; i++)
+        if (!old[i].empty())
+        {
+            str& s = slots[lookup(old[i])];
+            ::memcpy((void*)&s, (void*)&old[i], sizeof(str));  // move
+        }
+    pmemfree(old);
+}
+
+
+void strpool::intern(str& s)
+{
+    if (s.empty())
+        return;
+#ifdef SHN_THR
+    scopelock lock(mtx);
+#endif
+    if ((count + 1) * 2 > capacity)
+        rehash(imax<memint>(capacity * 2, 64));
+    str& slot = slots[lookup(s)];
+    if (slot.empty())
+    {
+        slot = s;
+        count++;
+    }
+    else
+        s = slot;
+}
+
+
+bool strpool::find(str& s)
+{
+    if (s.empty())
+        return false;
+#ifdef SHN_THR
+    scopelock lock(mtx);
+#endif
+    if (capacity == 0)
+        return false;
+    str& slot = slots[lookup(s)];
+    if (slot.empty())
+        return false;
+    s = slot;
+    return true;
+}
+
+
+void strpool::purge()
+{
+#ifdef SHN_THR
+    scopelock lock(mtx);
+#endif
+    // Only the pool can add references to a string it holds exclusively,
+    // so the uniqueness check is safe even if other threads are running
+    memint n = count;
+    for (memint i = 0; i < capacity; i++)
+        if (!slots[i].empty() && slots[i]._isunique())
+        {
+            slots[i].clear();
+            n--;
+        }
+    if (n < count)
+    {
+        count = n;
+        rehash(capacity);
+    }
+}
+
+
+void strpool::clear()
+{
+#ifdef SHN_THR
+    scopelock lock(mtx);
+#endif
+    for (memint i = 0; i < capacity; i++)
+        slots[i].clear();
+    pmemfree(slots);
+    slots = NULL;
+    capacity = count = 0;
+}
+
+
 // --- ordset -------------------------------------------------------------- //
 
 
@@ -983,115 +1399,997 @@ void ordset::find_insert(integer l, integer h)  { _getunique().include(int(l), i
 void ordset::find_erase(integer v)              { if (!empty()) _getunique().exclude(int(v)); }
 
 
-// --- range --------------------------------------------------------------- //
-
+// --- intset -------------------------------------------------------------- //
 
-range::range(integer l, integer r) throw()
-    : obj(l > r ? NULL : new rangeobj(l, r))  { }
 
-range::~range() throw()
-    { }
+static int _sign(memint d)
+    { return d < 0 ? -1 : d > 0 ? 1 : 0; }
 
 
-memint range::compare(const range& r) const
+static void _setbits(uinteger* w, memint l, memint r)
 {
-    if (empty())
-        return r.empty() ? 0 : -1;
-    if (r.empty())
-        return 1;
-    integer d = obj->left - r.obj->left;
-    if (d < 0)
-        return -1;
-    else if (d > 0)
-        return 1;
+    // Sets bits l..r inclusive
+    memint lw = l / intset::WORD_BITS, rw = r / intset::WORD_BITS;
+    uinteger lmask = ~uinteger(0) << (l % intset::WORD_BITS);
+    uinteger rmask = ~uinteger(0) >> (intset::WORD_BITS - 1 - r % intset::WORD_BITS);
+    if (lw == rw)
+        w[lw] |= lmask & rmask;
     else
     {
-        d = obj->right - r.obj->right;
-        return d < 0 ? -1 : d > 0 ? 1 : 0;
+        w[lw] |= lmask;
+        for (memint i = lw + 1; i < rw; i++)
+            w[i] = ~uinteger(0);
+        w[rw] |= rmask;
     }
 }
 
 
-bool range::operator ==(const range& r) const
+static uinteger _rangemask(memint k, memint l, memint r)
 {
-    if (empty())
-        return r.empty();
-    if (r.empty())
-        return false;
-    return obj->left == r.obj->left && obj->right == r.obj->right;
+    // Bits of the k-th word that fall in l..r inclusive
+    memint lo = k * intset::WORD_BITS, hi = lo + intset::WORD_BITS - 1;
+    uinteger m = ~uinteger(0);
+    if (l > lo)
+        m &= ~uinteger(0) << (l - lo);
+    if (r < hi)
+        m &= ~uinteger(0) >> (hi - r);
+    return m;
 }
 
 
-// --- object collections -------------------------------------------------- //
-
+intset::block::block(const block& b) throw()
+    : object(), key(b.key), kind(b.kind), card(b.card), arr(b.arr), bits(b.bits)  { }
 
-// template class podvec<object*>;
+intset::block::~block() throw()
+    { }
 
 
-void objvec_impl::release_all() throw()
+bool intset::block::contains(lowint v) const
 {
-    // TODO: more optimal destruction
-    for (memint i = size(); i--; )
-        operator[](i)->release();
+    switch (kind)
+    {
+    case ARRAY:
+        return arr.find(v);
+    case BITMAP:
+        return (words()[v / WORD_BITS] >> (v % WORD_BITS)) & 1;
+    case RUNS:
+        {
+            memint r = find_run(v);
+            return r >= 0 && v <= memint(arr[r * 2]) + arr[r * 2 + 1];
+        }
+    }
+    return false;
 }
 
 
-symbol::~symbol() throw()  { }
+memint intset::block::find_run(lowint v) const
+{
+    memint low = 0, high = runs() - 1;
+    while (low <= high)
+    {
+        memint mid = (low + high) / 2;
+        if (arr[mid * 2] <= v)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return high;
+}
 
 
-symbol* symtbl_impl::find(const str& name) const
+void intset::block::to_bitmap()
 {
-    memint i;
-    if (bsearch(name, i))
-        return operator[](i);
+    if (kind == BITMAP)
+        return;
+    bytevec b(BITMAP_WORDS * int(sizeof(uinteger)), 0);
+    uinteger* w = (uinteger*)b.atw(0);
+    if (kind == ARRAY)
+        for (memint i = 0; i < arr.size(); i++)
+            w[arr[i] / WORD_BITS] |= uinteger(1) << (arr[i] % WORD_BITS);
     else
-        return NULL;
+        for (memint i = 0; i < runs(); i++)
+            _setbits(w, arr[i * 2], memint(arr[i * 2]) + arr[i * 2 + 1]);
+    bits = b;
+    arr.clear();
+    kind = BITMAP;
 }
 
 
-bool symtbl_impl::add(symbol* s)
+void intset::block::normalize()
 {
-    if (s->name.empty())
-        fatal(0x1003, "Empty symbol in symbol table");
-    memint i;
-    if (bsearch(s->name, i))
-        return false;
-    insert(i, s);
-    return true;
+    if (kind == ARRAY && card > ARRAY_MAX)
+        to_bitmap();
+    else if (kind == BITMAP && card <= ARRAY_MAX)
+    {
+        const uinteger* w = words();
+        arr.clear();
+        for (memint i = 0; i < BITMAP_WORDS; i++)
+            for (uinteger t = w[i]; t; t &= t - 1)
+                arr.push_back(lowint(i * WORD_BITS + lowbit(t)));
+        bits.clear();
+        kind = ARRAY;
+    }
 }
 
 
-bool symtbl_impl::replace(symbol* s)
+void intset::block::compact_runs()
 {
-    memint i;
-    if (!bsearch(s->name, i))
-        return false;
-    parent::replace(i, s);
-    return true;
+    // The reverse of optimize()
+    memint cost = card <= ARRAY_MAX ? card * memint(sizeof(lowint)) : BITMAP_WORDS * memint(sizeof(uinteger));
+    if (runs() * 2 * memint(sizeof(lowint)) >= cost)
+    {
+        to_bitmap();
+        normalize();
+    }
 }
 
 
-bool symtbl_impl::bsearch(const str& key, memint& idx) const
+bool intset::block::insert(lowint v)
 {
-    idx = 0;
-    memint low = 0;
-    memint high = size() - 1;
-    while (low <= high) 
+    if (kind == RUNS)
     {
-        idx = (low + high) / 2;
-        memint comp = operator[](idx)->name.compare(key);
-        if (comp < 0)
-            low = idx + 1;
-        else if (comp > 0)
-            high = idx - 1;
+        // Extend or join the neighbouring runs, or add a new one
+        memint r = find_run(v);
+        if (r >= 0 && v <= memint(arr[r * 2]) + arr[r * 2 + 1])
+            return false;
+        bool joinsPrev = r >= 0 && memint(arr[r * 2]) + arr[r * 2 + 1] + 1 == v;
+        bool joinsNext = r + 1 < runs() && memint(v) + 1 == arr[r * 2 + 2];
+        if (joinsPrev && joinsNext)
+        {
+            arr.atw(r * 2 + 1) = lowint(arr[r * 2 + 1] + arr[r * 2 + 3] + 2);
+            arr.erase(r * 2 + 2, 2);
+        }
+        else if (joinsPrev)
+            arr.atw(r * 2 + 1)++;
+        else if (joinsNext)
+        {
+            arr.atw(r * 2 + 2) = v;
+            arr.atw(r * 2 + 3)++;
+        }
         else
-            return true;
+        {
+            arr.insert(r * 2 + 2, lowint(0));
+            arr.insert(r * 2 + 2, v);
+        }
+        card++;
+        compact_runs();
+        return true;
+    }
+    if (kind == ARRAY)
+    {
+        memint i;
+        if (arr.bsearch(v, i))
+            return false;
+        if (card < ARRAY_MAX)
+        {
+            arr.insert(i, v);
+            card++;
+            return true;
+        }
+        to_bitmap();
+    }
+    uinteger& w = words()[v / WORD_BITS];
+    uinteger m = uinteger(1) << (v % WORD_BITS);
+    if (w & m)
+        return false;
+    w |= m;
+    card++;
+    return true;
+}
+
+
+void intset::block::insert(lowint l, lowint h)
+{
+    if (card == 0)
+    {
+        kind = RUNS;
+        arr.push_back(l);
+        arr.push_back(lowint(h - l));
+        card = memint(h) - l + 1;
+        return;
+    }
+    to_bitmap();
+    uinteger* w = words();
+    _setbits(w, l, h);
+    card = 0;
+    for (memint i = 0; i < BITMAP_WORDS; i++)
+        card += bitcount(w[i]);
+    normalize();
+}
+
+
+bool intset::block::erase(lowint v)
+{
+    if (kind == RUNS)
+    {
+        // Shrink or split the run that holds v
+        memint r = find_run(v);
+        if (r < 0 || v > memint(arr[r * 2]) + arr[r * 2 + 1])
+            return false;
+        lowint s = arr[r * 2], n = arr[r * 2 + 1];  // start, length - 1
+        if (n == 0)
+            arr.erase(r * 2, 2);
+        else if (v == s)
+        {
+            arr.atw(r * 2) = lowint(s + 1);
+            arr.atw(r * 2 + 1) = lowint(n - 1);
+        }
+        else if (v == s + n)
+            arr.atw(r * 2 + 1) = lowint(n - 1);
+        else
+        {
+            arr.atw(r * 2 + 1) = lowint(v - s - 1);
+            arr.insert(r * 2 + 2, lowint(s + n - v - 1));
+            arr.insert(r * 2 + 2, lowint(v + 1));
+        }
+        card--;
+        compact_runs();
+        return true;
+    }
+    if (kind == ARRAY)
+    {
+        memint i;
+        if (!arr.bsearch(v, i))
+            return false;
+        arr.erase(i);
+        card--;
+        return true;
+    }
+    uinteger& w = words()[v / WORD_BITS];
+    uinteger m = uinteger(1) << (v % WORD_BITS);
+    if (!(w & m))
+        return false;
+    w &= ~m;
+    card--;
+    normalize();
+    return true;
+}
+
+
+memint intset::block::count_runs() const
+{
+    memint n = 0;
+    if (kind == ARRAY)
+    {
+        for (memint i = 0; i < arr.size(); i++)
+            if (i == 0 || arr[i] != arr[i - 1] + 1)
+                n++;
+    }
+    else if (kind == BITMAP)
+    {
+        // A run starts at every set bit whose lower neighbour is not set
+        const uinteger* w = words();
+        uinteger carry = 0;
+        for (memint i = 0; i < BITMAP_WORDS; i++)
+        {
+            n += bitcount(w[i] & ~((w[i] << 1) | carry));
+            carry = w[i] >> (WORD_BITS - 1);
+        }
+    }
+    else
+        n = runs();
+    return n;
+}
+
+
+void intset::block::optimize()
+{
+    if (kind == RUNS)
+        return;
+    memint n = count_runs();
+    memint cost = kind == ARRAY ? card * memint(sizeof(lowint)) : BITMAP_WORDS * memint(sizeof(uinteger));
+    if (n * 2 * memint(sizeof(lowint)) >= cost)
+        return;
+    podvec<lowint> r;
+    memint start = -1, prev = -2;
+    for (memint i = 0, pos = 0, posrank = 0; i < card; i++)
+    {
+        memint v = low_at(i, pos, posrank);
+        if (v != prev + 1)
+        {
+            if (start >= 0)
+                { r.push_back(lowint(start)); r.push_back(lowint(prev - start)); }
+            start = v;
+        }
+        prev = v;
+    }
+    r.push_back(lowint(start));
+    r.push_back(lowint(prev - start));
+    arr = r;
+    bits.clear();
+    kind = RUNS;
+}
+
+
+integer intset::block::low_at(memint i, memint& pos, memint& posrank) const
+{
+    // pos/posrank is a cursor: a word or run index and the number of values
+    // that precede it in this block
+    if (kind == ARRAY)
+        return arr[i];
+    if (i < posrank)
+        pos = posrank = 0;
+    if (kind == RUNS)
+    {
+        while (posrank + arr[pos * 2 + 1] + 1 <= i)
+            { posrank += arr[pos * 2 + 1] + 1; pos++; }
+        return arr[pos * 2] + (i - posrank);
+    }
+    const uinteger* w = words();
+    memint c;
+    while (posrank + (c = bitcount(w[pos])) <= i)
+        { posrank += c; pos++; }
+    uinteger t = w[pos];
+    for (memint k = i - posrank; k--; )
+        t &= t - 1;
+    return pos * WORD_BITS + lowbit(t);
+}
+
+
+bool intset::block::next(lowint v, lowint& r) const
+{
+    switch (kind)
+    {
+    case ARRAY:
+        {
+            memint i;
+            arr.bsearch(v, i);
+            if (i >= arr.size())
+                return false;
+            r = arr[i];
+            return true;
+        }
+    case BITMAP:
+        {
+            const uinteger* w = words();
+            memint i = v / WORD_BITS;
+            uinteger t = w[i] & (~uinteger(0) << (v % WORD_BITS));
+            while (t == 0)
+            {
+                if (++i >= BITMAP_WORDS)
+                    return false;
+                t = w[i];
+            }
+            r = lowint(i * WORD_BITS + lowbit(t));
+            return true;
+        }
+    case RUNS:
+        {
+            // The last run that starts at or before v, as in contains()
+            memint low = 0, high = runs() - 1;
+            while (low <= high)
+            {
+                memint mid = (low + high) / 2;
+                if (arr[mid * 2] <= v)
+                    low = mid + 1;
+                else
+                    high = mid - 1;
+            }
+            if (high >= 0 && v <= memint(arr[high * 2]) + arr[high * 2 + 1])
+                { r = v; return true; }
+            if (low >= runs())
+                return false;
+            r = arr[low * 2];
+            return true;
+        }
     }
-    idx = low;
     return false;
 }
 
 
+void intset::block::push_run(memint l, memint h)
+{
+    arr.push_back(lowint(l));
+    arr.push_back(lowint(h - l));
+    card += h - l + 1;
+}
+
+
+void intset::block::merge_runs(const block& x, const block& y, SetOp op)
+{
+    // Both blocks are runs; the result is stored in this block as runs
+    arr.clear();
+    card = 0;
+    memint i = 0, j = 0, nx = x.runs(), ny = y.runs();
+    switch (op)
+    {
+    case UNITE:
+        {
+            memint l = -1, h = -2;
+            while (i < nx || j < ny)
+            {
+                memint nl, nh;
+                if (j >= ny || (i < nx && x.run_start(i) < y.run_start(j)))
+                    { nl = x.run_start(i); nh = x.run_end(i); i++; }
+                else
+                    { nl = y.run_start(j); nh = y.run_end(j); j++; }
+                if (nl <= h + 1)
+                    h = imax(h, nh);
+                else
+                {
+                    if (l >= 0)
+                        push_run(l, h);
+                    l = nl;
+                    h = nh;
+                }
+            }
+            if (l >= 0)
+                push_run(l, h);
+        }
+        break;
+    case INTERSECT:
+        while (i < nx && j < ny)
+        {
+            memint l = imax(x.run_start(i), y.run_start(j)), h = imin(x.run_end(i), y.run_end(j));
+            if (l <= h)
+                push_run(l, h);
+            if (x.run_end(i) < y.run_end(j))
+                i++;
+            else
+                j++;
+        }
+        break;
+    case SUBTRACT:
+        for (; i < nx; i++)
+        {
+            memint l = x.run_start(i), h = x.run_end(i);
+            while (j < ny && y.run_end(j) < l)
+                j++;
+            for (memint k = j; k < ny && y.run_start(k) <= h && l <= h; k++)
+            {
+                if (y.run_start(k) > l)
+                    push_run(l, y.run_start(k) - 1);
+                l = y.run_end(k) + 1;
+            }
+            if (l <= h)
+                push_run(l, h);
+        }
+        break;
+    }
+}
+
+
+intset::block* intset::block::combine(const block& x, const block& y, SetOp op)
+{
+    // Arrays are merged, or probed against the other block; runs are merged
+    // as runs, and only two bitmaps are combined word by word
+    block* r;
+    if (x.kind == ARRAY && y.kind == ARRAY)
+    {
+        r = new block(x.key);
+        memint i = 0, j = 0;
+        while (i < x.arr.size() && j < y.arr.size())
+        {
+            lowint a = x.arr[i], b = y.arr[j];
+            if (a <= b && op != INTERSECT && (a < b || op == UNITE))
+                r->arr.push_back(a);
+            else if (b < a && op == UNITE)
+                r->arr.push_back(b);
+            else if (a == b && op == INTERSECT)
+                r->arr.push_back(a);
+            i += a <= b;
+            j += b <= a;
+        }
+        if (op != INTERSECT)
+            for (; i < x.arr.size(); i++)
+                r->arr.push_back(x.arr[i]);
+        if (op == UNITE)
+            for (; j < y.arr.size(); j++)
+                r->arr.push_back(y.arr[j]);
+        r->card = r->arr.size();
+    }
+    else if (x.kind == ARRAY || y.kind == ARRAY)
+    {
+        const block& a = x.kind == ARRAY ? x : y;
+        const block& b = x.kind == ARRAY ? y : x;
+        if (op == INTERSECT || (op == SUBTRACT && &a == &x))
+        {
+            r = new block(x.key);
+            for (memint i = 0; i < a.arr.size(); i++)
+                if (b.contains(a.arr[i]) == (op == INTERSECT))
+                    r->arr.push_back(a.arr[i]);
+            r->card = r->arr.size();
+        }
+        else
+        {
+            r = new block(b);
+            for (memint i = 0; i < a.arr.size(); i++)
+                if (op == UNITE)
+                    r->insert(a.arr[i]);
+                else
+                    r->erase(a.arr[i]);
+        }
+    }
+    else if (x.kind == RUNS && y.kind == RUNS)
+    {
+        r = new block(x.key);
+        r->kind = RUNS;
+        r->merge_runs(x, y, op);
+    }
+    else if (x.kind == BITMAP && y.kind == BITMAP)
+    {
+        r = new block(x);
+        uinteger* w = r->words();
+        const uinteger* t = y.words();
+        memint card = 0;
+        for (memint k = 0; k < BITMAP_WORDS; k++)
+        {
+            switch (op)
+            {
+                case UNITE:     w[k] |= t[k]; break;
+                case INTERSECT: w[k] &= t[k]; break;
+                case SUBTRACT:  w[k] &= ~t[k]; break;
+            }
+            card += bitcount(w[k]);
+        }
+        r->card = card;
+    }
+    else
+    {
+        // Runs and a bitmap: only the words covered by the runs are touched
+        const block& a = x.kind == RUNS ? x : y;
+        const block& b = x.kind == RUNS ? y : x;
+        uinteger* w;
+        if (op == UNITE || (op == SUBTRACT && &b == &x))
+        {
+            r = new block(b);
+            w = r->words();
+            for (memint i = 0; i < a.runs(); i++)
+            {
+                memint l = a.run_start(i), h = a.run_end(i);
+                if (op == UNITE)
+                    _setbits(w, l, h);
+                else
+                    for (memint k = l / WORD_BITS; k <= h / WORD_BITS; k++)
+                        w[k] &= ~_rangemask(k, l, h);
+            }
+        }
+        else
+        {
+            r = new block(x.key);
+            r->bits = bytevec(BITMAP_WORDS * int(sizeof(uinteger)), 0);
+            r->kind = BITMAP;
+            w = r->words();
+            const uinteger* t = b.words();
+            for (memint i = 0; i < a.runs(); i++)
+            {
+                memint l = a.run_start(i), h = a.run_end(i);
+                for (memint k = l / WORD_BITS; k <= h / WORD_BITS; k++)
+                    w[k] |= (op == INTERSECT ? t[k] : ~t[k]) & _rangemask(k, l, h);
+            }
+        }
+        r->card = 0;
+        for (memint k = 0; k < BITMAP_WORDS; k++)
+            r->card += bitcount(w[k]);
+    }
+    if (r->card == 0)
+    {
+        delete r;
+        return NULL;
+    }
+    if (r->kind == RUNS)
+        r->compact_runs();
+    else
+        r->normalize();
+    return r;
+}
+
+
+intset::setobj::setobj() throw()
+    : blocks(), size(0), hash(0)  { }
+
+
+intset::setobj::setobj(const setobj& s) throw()
+    : object(), blocks(s.blocks), size(s.size), hash(0)
+{
+    for (memint i = 0; i < blocks.size(); i++)
+        blocks[i]->grab();
+}
+
+
+intset::setobj::~setobj() throw()
+    { blocks.release_all(); }
+
+
+intset::intset(integer v) throw()
+    : obj()  { find_insert(v); }
+
+
+intset::intset(integer l, integer r) throw()
+    : obj()  { find_insert(l, r); }
+
+
+intset::setobj* intset::_getunique()
+{
+    if (obj.empty())
+        obj = new setobj();
+    else if (!obj.isunique())
+        obj = new setobj(*obj);
+    else
+        obj->hash = 0;
+    return obj;
+}
+
+
+bool intset::_bsearch(integer key, memint& idx) const
+{
+    idx = 0;
+    if (obj.empty())
+        return false;
+    memint low = 0;
+    memint high = obj->blocks.size() - 1;
+    while (low <= high)
+    {
+        idx = (low + high) / 2;
+        integer k = obj->blocks[idx]->key;
+        if (k < key)
+            low = idx + 1;
+        else if (k > key)
+            high = idx - 1;
+        else
+            return true;
+    }
+    idx = low;
+    return false;
+}
+
+
+intset::block* intset::_getblock(integer key, bool create)
+{
+    setobj* o = _getunique();
+    memint idx;
+    if (_bsearch(key, idx))
+    {
+        block* b = o->blocks[idx];
+        if (!b->isunique())
+            _putblock(idx, b = new block(*b));
+        return b;
+    }
+    if (!create)
+        return NULL;
+    block* b = new block(key);
+    o->blocks.insert(idx, b);
+    b->grab();
+    return b;
+}
+
+
+void intset::_putblock(memint idx, block* b)
+{
+    block* old = obj->blocks[idx];
+    obj->blocks.replace(idx, b);
+    b->grab();
+    old->release();
+}
+
+
+bool intset::find(integer v) const
+{
+    memint idx;
+    if (!_bsearch(_key(v), idx))
+        return false;
+    return obj->blocks[idx]->contains(_low(v));
+}
+
+
+void intset::find_insert(integer v)
+{
+    if (_getblock(_key(v), true)->insert(_low(v)))
+        obj->size++;
+}
+
+
+void intset::find_insert(integer l, integer h)
+{
+    if (l > h)
+        return;
+    integer kl = _key(l), kh = _key(h);
+    for (integer k = kl; k <= kh; k++)
+    {
+        block* b = _getblock(k, true);
+        memint old = b->card;
+        b->insert(k == kl ? _low(l) : 0, k == kh ? _low(h) : lowint(BLOCK_SIZE - 1));
+        obj->size += b->card - old;
+    }
+}
+
+
+void intset::find_erase(integer v)
+{
+    memint idx;
+    if (!_bsearch(_key(v), idx))
+        container::keyerr();
+    block* b = _getblock(_key(v), false);
+    if (!b->erase(_low(v)))
+        container::keyerr();
+    obj->size--;
+    if (b->card == 0)
+    {
+        obj->blocks.erase(idx);
+        b->release();
+        if (obj->size == 0)
+            clear();
+    }
+}
+
+
+integer intset::at(memint i, cursor& c) const
+{
+    // The set itself is not modified, so that it can be shared between
+    // threads and iterated by nested loops
+    if (umemint(i) >= umemint(size()))
+        container::idxerr();
+    if (i < c.index)
+        c = cursor();
+    block* b;
+    while (c.rank + (b = obj->blocks[c.blk])->card <= i)
+    {
+        c.rank += b->card;
+        c.blk++;
+        c.pos = c.posrank = 0;
+    }
+    c.index = i;
+    return b->key * BLOCK_SIZE + b->low_at(i - c.rank, c.pos, c.posrank);
+}
+
+
+bool intset::next(integer& v) const
+{
+    memint idx;
+    if (_bsearch(_key(v), idx))
+    {
+        lowint r;
+        if (obj->blocks[idx]->next(_low(v), r))
+            { v = _key(v) * BLOCK_SIZE + r; return true; }
+        idx++;
+    }
+    if (obj.empty() || idx >= obj->blocks.size())
+        return false;
+    memint pos = 0, posrank = 0;
+    block* b = obj->blocks[idx];
+    v = b->key * BLOCK_SIZE + b->low_at(0, pos, posrank);
+    return true;
+}
+
+
+void intset::optimize()
+{
+    if (empty())
+        return;
+    for (memint i = 0; i < obj->blocks.size(); i++)
+        _getblock(obj->blocks[i]->key, false)->optimize();
+}
+
+
+memint intset::compare(const intset& s) const
+{
+    if (obj == s.obj)
+        return 0;
+    memint n = imin(size(), s.size());
+    cursor c, sc;
+    for (memint i = 0; i < n; i++)
+    {
+        integer a = at(i, c), b = s.at(i, sc);
+        if (a != b)
+            return a < b ? -1 : 1;
+    }
+    return _sign(size() - s.size());
+}
+
+
+uinteger intset::hash() const
+{
+    if (empty())
+        return 0;
+    if (obj->hash == 0)
+    {
+        uinteger h = size();
+        cursor c;
+        for (memint i = 0; i < size(); i++)
+            h = _hashmix(h, at(i, c));
+        obj->hash = h ? h : 1;
+    }
+    return obj->hash;
+}
+
+
+void intset::_setop(const intset& s, SetOp op)
+{
+    if (obj == s.obj)  // x + x = x * x = x
+    {
+        if (op == SUBTRACT)
+            clear();
+        return;
+    }
+    if (s.empty())
+    {
+        if (op == INTERSECT)
+            clear();
+        return;
+    }
+    if (empty())
+    {
+        if (op == UNITE)
+            *this = s;
+        return;
+    }
+    setobj* o = _getunique();
+    const objvec<block>& a = o->blocks;
+    const objvec<block>& b = s.obj->blocks;
+    objvec<block> result;
+    memint size = 0;
+    for (memint i = 0, j = 0; i < a.size() || j < b.size(); )
+    {
+        block* x = i < a.size() ? a[i] : NULL;
+        block* y = j < b.size() ? b[j] : NULL;
+        block* r = NULL;
+        if (y == NULL || (x != NULL && x->key < y->key))
+        {
+            if (op != INTERSECT)
+                r = x;
+            i++;
+        }
+        else if (x == NULL || y->key < x->key)
+        {
+            if (op == UNITE)
+                r = y;
+            j++;
+        }
+        else
+        {
+            r = block::combine(*x, *y, op);
+            i++;
+            j++;
+        }
+        if (r != NULL)
+        {
+            result.push_back(r)->grab();
+            size += r->card;
+        }
+    }
+    o->blocks.release_all();
+    o->blocks = result;
+    o->size = size;
+    if (size == 0)
+        clear();
+}
+
+
+// --- range --------------------------------------------------------------- //
+
+
+range::range(integer l, integer r) throw()
+    : obj(l > r ? NULL : new rangeobj(l, r))  { }
+
+range::~range() throw()
+    { }
+
+
+memint range::compare(const range& r) const
+{
+    if (empty())
+        return r.empty() ? 0 : -1;
+    if (r.empty())
+        return 1;
+    integer d = obj->left - r.obj->left;
+    if (d < 0)
+        return -1;
+    else if (d > 0)
+        return 1;
+    else
+    {
+        d = obj->right - r.obj->right;
+        return d < 0 ? -1 : d > 0 ? 1 : 0;
+    }
+}
+
+
+bool range::operator ==(const range& r) const
+{
+    if (empty())
+        return r.empty();
+    if (r.empty())
+        return false;
+    return obj->left == r.obj->left && obj->right == r.obj->right;
+}
+
+
+// --- object collections -------------------------------------------------- //
+
+
+// template class podvec<object*>;
+
+
+void objvec_impl::release_all() throw()
+{
+    // TODO: more optimal destruction
+    for (memint i = size(); i--; )
+        operator[](i)->release();
+}
+
+
+symbol::~symbol() throw()  { }
+
+
+symtbl_impl::~symtbl_impl() throw()
+    { pmemfree(slots); }
+
+
+memint symtbl_impl::lookup(const str& key) const
+{
+    // Returns the slot that either holds the symbol or should receive it
+    memint mask = capacity - 1;
+    for (memint i = key.hash() & mask; ; i = (i + 1) & mask)
+    {
+        memint k = slots[i];
+        if (k == 0)
+            return i;
+        const str& name = operator[](k - 1)->name;
+        if (name.data() == key.data() || name == key)
+            return i;
+    }
+}
+
+
+void symtbl_impl::rehash()
+{
+    pmemfree(slots);
+    capacity = imax<memint>(capacity * 2, 16);
+    slots = (memint*)pmemcalloc(capacity * sizeof(memint));
+    for (memint k = 0; k < size(); k++)
+        slots[lookup(operator[](k)->name)] = k + 1;
+}
+
+
+symbol* symtbl_impl::find(const str& name) const
+{
+    if (capacity == 0)
+        return NULL;
+    memint k = slots[lookup(name)];
+    return k ? operator[](k - 1) : NULL;
+}
+
+
+memint symtbl_impl::index_of(const str& name) const
+    { return capacity == 0 ? -1 : slots[lookup(name)] - 1; }
+
+
+bool symtbl_impl::add(symbol* s)
+{
+    if (s->name.empty())
+        fatal(0x1003, "Empty symbol in symbol table");
+    if ((size() + 1) * 2 > capacity)
+        rehash();
+    memint i = lookup(s->name);
+    if (slots[i])
+        return false;
+    push_back(s);
+    slots[i] = size();
+    return true;
+}
+
+
+void symtbl_impl::clear()
+{
+    parent::clear();
+    pmemfree(slots);
+    slots = NULL;
+    capacity = 0;
+}
+
+
+bool symtbl_impl::replace(symbol* s)
+{
+    if (capacity == 0)
+        return false;
+    memint k = slots[lookup(s->name)];
+    if (k == 0)
+        return false;
+    parent::replace(k - 1, s);
+    return true;
+}
+
+
 // --- Exceptions ---------------------------------------------------------- //
 
 
@@ -1162,6 +2460,91 @@ void variant::operator= (const variant& v) throw()
 #endif
 
 
+static memint _veccompare(const varvec& a, const varvec& b)
+{
+    if (a == b)  // same object or both empty
+        return 0;
+    memint n = imin(a.size(), b.size());
+    for (memint i = 0; i < n; i++)
+    {
+        memint c = a[i].compare(b[i]);
+        if (c != 0)
+            return c;
+    }
+    return _sign(a.size() - b.size());
+}
+
+
+static memint _dictcompare(const vardict& a, const vardict& b)
+{
+    if (a == b)
+        return 0;
+    memint n = imin(a.size(), b.size());
+    for (memint i = 0; i < n; i++)
+    {
+        memint c = a.key(i).compare(b.key(i));
+        if (c == 0)
+            c = a.value(i).compare(b.value(i));
+        if (c != 0)
+            return c;
+    }
+    return _sign(a.size() - b.size());
+}
+
+
+static uinteger _vechash(const varvec& v)
+{
+    if (v.empty())
+        return 0;
+    container* c = container::cont(pchar(v.begin()));
+    uinteger h = c->hash();
+    if (h == 0)
+    {
+        h = v.size();
+        for (memint i = 0; i < v.size(); i++)
+            h = _hashmix(h, v[i].hash());
+        if (h == 0)
+            h = 1;
+        c->set_hash(h);
+    }
+    return h;
+}
+
+
+// Returns true only if both hashes are already known and they differ
+static bool _vechashdiff(const varvec& a, const varvec& b)
+{
+    if (a.empty() || b.empty())
+        return false;
+    uinteger ha = container::cont(pchar(a.begin()))->hash();
+    uinteger hb = container::cont(pchar(b.begin()))->hash();
+    return ha != 0 && hb != 0 && ha != hb;
+}
+
+
+uinteger variant::hash() const
+{
+    uinteger h = 0;
+    switch(type)
+    {
+        case VOID:      break;
+        case ORD:       h = val._ord; break;
+        case REAL:      h = val._all; break;
+        case VARPTR:    h = uinteger(val._ptr); break;
+        case STR:       h = _str().hash(); break;
+        case RANGE:     if (!_range().empty()) h = _hashmix(_range().left(), _range().right()); break;
+        case VEC:       h = _vechash(_vec()); break;
+        case SET:       h = _vechash(_set()); break;
+        case ORDSET:    h = _ordset().get_charset().hash(); break;
+        case INTSET:    h = _intset().hash(); break;
+        case DICT:      if (!_dict().empty()) h = _hashmix(_vechash(_dict().obj->keys), _vechash(_dict().obj->values)); break;
+        case REF:
+        case RTOBJ:     h = uinteger(_anyobj()); break;
+    }
+    return _hashmix(uinteger(type), h);
+}
+
+
 memint variant::compare(const variant& v) const
 {
     if (type == v.type)
@@ -1183,11 +2566,16 @@ memint variant::compare(const variant& v) const
             return _str().compare(v._str());
         case RANGE:
             return _range().compare(v._range());
-        // TODO: define "deep" comparison, at least for vectors?
         case VEC:
+            return _veccompare(_vec(), v._vec());
         case SET:
+            return _veccompare(_set(), v._set());
         case ORDSET:
+            return _sign(_ordset().compare(v._ordset()));
+        case INTSET:
+            return _intset().compare(v._intset());
         case DICT:
+            return _dictcompare(_dict(), v._dict());
         case REF:
         case RTOBJ:
             return memint(_anyobj()) - memint(v._anyobj());
@@ -1209,10 +2597,13 @@ bool variant::operator== (const variant& v) const
             case VARPTR:    return val._ptr == v.val._ptr;
             case STR:       return _str() == v._str();
             case RANGE:     return _range() == v._range();
-            case VEC:       return _vec() == v._vec();
-            case SET:       return _set() == v._set();
+            case VEC:       return _vec() == v._vec()
+                                || (!_vechashdiff(_vec(), v._vec()) && _veccompare(_vec(), v._vec()) == 0);
+            case SET:       return _set() == v._set()
+                                || (!_vechashdiff(_set(), v._set()) && _veccompare(_set(), v._set()) == 0);
             case ORDSET:    return _ordset() == v._ordset();
-            case DICT:      return _dict() == v._dict();
+            case INTSET:    return _intset().size() == v._intset().size() && _intset() == v._intset();
+            case DICT:      return _dict() == v._dict() || _dictcompare(_dict(), v._dict()) == 0;
             case REF:       return _ref() == v._ref();
             case RTOBJ:     return _rtobj() == v._rtobj();
         }
@@ -1234,6 +2625,7 @@ bool variant::empty() const
         case VEC:       return _vec().empty();
         case SET:       return _set().empty();
         case ORDSET:    return _ordset().empty();
+        case INTSET:    return _intset().empty();
         case DICT:      return _dict().empty();
         case REF:       return _ref()->var.empty();
         case RTOBJ:     return _rtobj() == NULL || _rtobj()->empty();
@@ -1315,13 +2707,21 @@ rtstack::rtstack(memint maxSize) throw()
 // template class vector<str>;
 
 
+static initcount runtimeInit;
+
+
 void initRuntime()
 {
+    initscope init(runtimeInit, true);
+    if (!init.needed())
+        return;
+
     // Some critical build integrity tests, unfortunately can't be done with macros:
     if (
             // Make sure all containers occupy exactly one pointer statically
-            sizeof(str) == sizeof(void*) && sizeof(symtbl_impl) == sizeof(void*)
+            sizeof(str) == sizeof(void*)
             && sizeof(vardict) == sizeof(void*) && sizeof(range) == sizeof(void*)
+            && sizeof(intset) == sizeof(void*)
             // memint is equivalent of ssize_t
             && sizeof(memint) == sizeof(void*)
             // Container indexes are memint, we keep them in integer vars, thus:
@@ -1331,10 +2731,23 @@ void initRuntime()
         ;
     else
         fatal(0x1004, "Broken build");
+
+    // Fully buffered output would be lost on internal errors otherwise
+    fatalHook = flushStdFiles;
 }
 
 
 void doneRuntime()
 {
+    initscope done(runtimeInit, false);
+    if (!done.needed())
+        return;
+    fatalHook = NULL;
+    sio.flush();
+    serr.flush();
+    strPool.clear();
+#ifdef SHN_PROFILE
+    allocprof::clear();
+#endif
 }
 
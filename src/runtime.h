@@ -42,9 +42,12 @@ public:
     void intersect(const charset& s);
     void invert();
     bool contains(int b) const                     { return (data[uchar(b) / 8] & (1 << (uchar(b) % 8))) != 0; }
-    bool compare(const charset& s) const           { return memcmp(data, s.data, BYTES); }
+    int next(int b) const;  // first element >= b or -1
+    const char* span(const char* p, const char* e) const;  // first char not in set
+    int compare(const charset& s) const            { return memcmp(data, s.data, BYTES); }
     bool eq(const charset& s) const                { return compare(s) == 0; }
     bool le(const charset& s) const;
+    uinteger hash() const;
 
     charset& operator=  (const charset& s)         { assign(s); return *this; }
     charset& operator+= (const charset& s)         { unite(s); return *this; }
@@ -66,6 +69,35 @@ public:
 };
 
 
+// Lookup table for scanning long spans of a charset, see fifo::_token().
+// Sets that exclude only a few characters, such as non_eol_chars, are
+// scanned a word at a time, others eight characters per branch.
+
+class charscan
+{
+public:
+    typedef charset::word word;
+    enum
+    {
+        MIN_SPAN = 16,  // spans shorter than this don't need a table
+        STOPS = 4
+    };
+
+protected:
+    typedef uint8_t uchar;
+
+    uchar members[charset::BITS];
+    word stops[STOPS];
+    int stopCount;  // > STOPS if the set excludes too many characters
+
+public:
+    charscan() throw()                             { }  // uninitialized
+    charscan(const charset& s) throw()             { assign(s); }
+    void assign(const charset&) throw();
+    const char* span(const char* p, const char* e) const;  // first char not in set
+};
+
+
 // --- object -------------------------------------------------------------- //
 
 
@@ -103,7 +135,7 @@ public:
     object* _dup(size_t self, memint extra);
 
     void _assignto(object*& p) throw();
-    static object* reallocate(object* p, size_t self, memint extra);
+    static object* reallocate(object* p, size_t self, memint oldextra, memint extra);
 
     static atomicint allocated; // used only in DEBUG mode
 
@@ -192,6 +224,52 @@ public:
 };
 
 
+// --- allocprof ----------------------------------------------------------- //
+
+
+// Allocation profiler, enabled with SHN_PROFILE (also in release builds).
+// The VM sets the current site, i.e. the State being executed and the line
+// number from the last opLineNum; all object allocations are then counted
+// against that site. Not thread-safe, hence not available with SHN_THR.
+
+#ifdef SHN_PROFILE
+
+#ifdef SHN_THR
+#  error "SHN_PROFILE can't be used with SHN_THR"
+#endif
+
+struct allocprof
+{
+    struct scope
+    {
+        Type* saveType;
+        integer saveLine;
+        scope(Type* t): saveType(curType), saveLine(curLine)
+            { curType = t; curLine = 0; }
+        ~scope()
+            { curType = saveType; curLine = saveLine; }
+    };
+
+    static Type* curType;
+    static integer curLine;
+
+    static void alloc(memint bytes);
+    static void realloc(memint delta);  // newsize - oldsize, may be negative
+    static void dump(fifo&);  // sorted by bytes, descending
+    static void clear();
+};
+
+#  define PROF_ALLOC(bytes)   allocprof::alloc(bytes)
+#  define PROF_REALLOC(bytes) allocprof::realloc(bytes)
+
+#else
+
+#  define PROF_ALLOC(bytes)   ((void)(bytes))
+#  define PROF_REALLOC(bytes) ((void)(bytes))
+
+#endif
+
+
 // --- container ----------------------------------------------------------- //
 
 
@@ -203,6 +281,7 @@ class container: public object
 protected:
     memint _capacity;
     memint _size;
+    uinteger _hash;  // cached structural hash, 0 if not known yet
     // char _data[0];
 
 public:
@@ -219,7 +298,7 @@ public:
 
     static memint _calc_prealloc(memint);
     container(memint cap, memint siz) throw()
-        : object(), _capacity(cap), _size(siz)  { }
+        : object(), _capacity(cap), _size(siz), _hash(0)  { }
 
     static void overflow();
     static void idxerr();
@@ -235,9 +314,17 @@ public:
     static container* cont(char* d) { return ((container*)d) - 1; }
     memint size() const             { return _size; }
     void set_size(memint newsize)
-        { assert(newsize > 0 && newsize <= _capacity); _size = newsize; }
-    void dec_size()                 { assert(_size > 0); _size--; }
+        { assert(newsize > 0 && newsize <= _capacity); _size = newsize; _hash = 0; }
+    void dec_size()                 { assert(_size > 0); _size--; _hash = 0; }
     memint capacity() const         { return _capacity; }
+
+    // Structural hash cache, see variant::hash(); any mutation should
+    // reset it via touch(). This is the only thing that's written to an
+    // otherwise shared container, so the constants of compiled code have
+    // it computed beforehand, see CodeGen::loadConst().
+    uinteger hash() const           { return _hash; }
+    void set_hash(uinteger h)       { _hash = h; }
+    void touch()                    { _hash = 0; }
 };
 
 
@@ -251,6 +338,7 @@ class bytevec
 {
     friend class variant;
     friend class CodeGen;
+    friend class strpool;
 
     friend void test_bytevec();
     friend void test_podvec();
@@ -266,7 +354,7 @@ protected:
     void chknz() const                  { if (empty()) container::idxerr(); }
     bool _isunique() const              { return empty() || obj->isunique(); }
     void _dounique();
-    char* mkunique()                    { if (!obj->isunique()) _dounique(); return obj->data(); }
+    char* mkunique()                    { if (!obj->isunique()) _dounique(); obj->touch(); return obj->data(); }
     char* _init(memint len) throw();  // (*)
     void _init(memint len, char fill) throw();  // (*)
     void _init(const char*, memint) throw();  // (*)
@@ -291,6 +379,7 @@ public:
     void operator= (const bytevec& v) throw()  { obj = v.obj; }
     bool operator== (const bytevec& v) const { return obj == v.obj; }
     void assign(const char*, memint);
+    void reassign(const char*, memint);  // (*) reuses the buffer if unique and big enough
     void clear();
 
     bool empty() const                  { return obj.empty(); }
@@ -304,7 +393,7 @@ public:
     const char* end() const             { return empty() ? NULL : obj->end(); }
     const char* back(memint i) const    { chkidxa(i); return obj->end() - i; }
     const char* back() const            { return back(1); }
-    char* backw(memint i)               { chkidxa(i); return obj->end() - i; }
+    char* backw(memint i)               { chkidxa(i); obj->touch(); return obj->end() - i; }
     char* backw()                       { return backw(1); }
 
     void insert(memint pos, const char* buf, memint len);  // (*)
@@ -386,6 +475,7 @@ public:
 
     memint compare(const char*, memint) const;
     memint compare(const str& s) const      { return compare(s.data(), s.size()); }
+    uinteger hash() const;
     bool operator== (const char* s) const;
     bool operator== (const str& s) const    { return compare(s.data(), s.size()) == 0; }
     bool operator== (char c) const          { return size() == 1 && *data() == c; }
@@ -414,6 +504,10 @@ inline str operator+ (char c, const str& s2)
 // --- string utilities ---------------------------------------------------- //
 
 
+// Converts the value to a string at the end of buf, which should be at least
+// 65 bytes long; returns a pointer to the first char and its length in len.
+// Only base 10 is signed.
+const char* _itobase(large value, char* buf, int base, int& len, bool _signed);
 str _to_string(large value, int base, int width, char fill);
 str _to_string(large);
 template<class T>
@@ -434,6 +528,39 @@ str to_quoted(const str&);
 str to_displayable(const str&);  // shortens to 40 chars + "..."
 
 
+// --- strpool ------------------------------------------------------------- //
+
+
+// Process-wide pool of interned strings: equal strings passed to intern()
+// end up sharing the same storage, so that comparing them is a pointer
+// check. The pool holds a reference to each string; purge() drops the ones
+// that are not used anywhere else.
+
+class strpool: noncopyable
+{
+protected:
+    str* slots;         // open addressing, linear probing
+    memint capacity;    // power of 2
+    memint count;
+#ifdef SHN_THR
+    mutex mtx;
+#endif
+    memint lookup(const str&) const;
+    void rehash(memint newcap);
+public:
+    strpool() throw();
+    ~strpool() throw();
+    void intern(str&);
+    bool find(str&);    // replaces the string with the pooled one if found
+    void purge();
+    void clear();
+    memint size() const     { return count; }
+};
+
+
+extern strpool strPool;
+
+
 // --- podvec -------------------------------------------------------------- //
 
 
@@ -898,17 +1025,27 @@ public:
 };
 
 
+// Symbols are kept in the order of addition and are indexed by a hash table
+// on their names; names that share the same string object (e.g. those
+// interned by the parser) are matched by pointer. Doesn't own the symbols.
+
 class symtbl_impl: public objvec<symbol>
 {
 protected:
     typedef objvec<symbol> parent;
-    bool bsearch(const str& key, memint& index) const;
+    memint* slots;      // symbol index + 1, or 0 if the slot is empty
+    memint capacity;    // power of 2
+    memint lookup(const str& key) const;
+    void rehash();
 public:
-    symtbl_impl() throw(): parent()  { }
-    symtbl_impl(const symtbl_impl& s) throw();
+    symtbl_impl() throw(): parent(), slots(NULL), capacity(0)  { }
+    symtbl_impl(const symtbl_impl& s) throw();  // trap
+    ~symtbl_impl() throw();
     symbol* find(const str& name) const; // NULL or symbol*
+    memint index_of(const str& name) const; // -1 if not found
     bool add(symbol*);
     bool replace(symbol*);
+    void clear();
 };
 
 
@@ -924,6 +1061,133 @@ public:
     bool add(T* t)                      { return parent::add(t); }
     bool replace(T* t)                  { return parent::replace(t); }
     void release_all() throw()          { parent::release_all(); }
+    void clear()                        { parent::clear(); }
+};
+
+
+// --- intset -------------------------------------------------------------- //
+
+
+// intset: compressed set of arbitrary integers, a.k.a. "roaring bitmap".
+// Values are grouped by their high bits into blocks of 65536; each block
+// keeps its low 16-bit parts either as a sorted array, a bitmap or a list of
+// runs, whichever is more compact. Blocks are shared between copies of a set
+// and are duplicated on write. Used for sets of non-byte ordinals.
+
+class intset
+{
+    friend class variant;
+    friend void test_intset();
+
+public:
+    typedef uint16_t lowint;
+    enum
+    {
+        BLOCK_BITS = 16,
+        BLOCK_SIZE = 1 << BLOCK_BITS,
+        ARRAY_MAX = 4096,  // larger array blocks are converted to bitmaps
+        WORD_BITS = int(sizeof(uinteger)) * 8,
+        BITMAP_WORDS = BLOCK_SIZE / WORD_BITS
+    };
+
+protected:
+    enum SetOp { UNITE, INTERSECT, SUBTRACT };
+
+    class block: public object
+    {
+    public:
+        enum Kind { ARRAY, BITMAP, RUNS };
+        integer const key;      // value >> BLOCK_BITS
+        Kind kind;
+        memint card;
+        podvec<lowint> arr;     // ARRAY: values; RUNS: (start, length - 1) pairs
+        bytevec bits;           // BITMAP
+
+        block(integer k) throw(): key(k), kind(ARRAY), card(0)  { }
+        block(const block&) throw();
+        ~block() throw();
+
+        const uinteger* words() const   { return (const uinteger*)bits.data(); }
+        uinteger* words()               { return (uinteger*)bits.atw(0); }
+        memint runs() const             { return arr.size() / 2; }
+        memint run_start(memint i) const { return arr[i * 2]; }
+        memint run_end(memint i) const  { return memint(arr[i * 2]) + arr[i * 2 + 1]; }
+
+        bool contains(lowint) const;
+        bool insert(lowint);
+        bool erase(lowint);
+        void insert(lowint, lowint);
+        memint find_run(lowint) const;  // last run that starts at or before the value, or -1
+        void to_bitmap();
+        void normalize();       // array or bitmap depending on cardinality
+        void compact_runs();    // RUNS: normalize if runs are no longer more compact
+        void optimize();        // convert to runs if that's more compact
+        memint count_runs() const;
+        integer low_at(memint i, memint& pos, memint& posrank) const;
+        bool next(lowint v, lowint& r) const;
+        void push_run(memint l, memint h);
+        void merge_runs(const block&, const block&, SetOp);
+        static block* combine(const block&, const block&, SetOp);  // NULL if empty
+    };
+
+    struct setobj: public object
+    {
+        objvec<block> blocks;   // sorted by key
+        memint size;
+        uinteger hash;
+        setobj() throw();
+        setobj(const setobj&) throw();
+        ~setobj() throw();
+    };
+
+    objptr<setobj> obj;
+
+    setobj* _getunique();
+    bool _bsearch(integer key, memint& idx) const;
+    block* _getblock(integer key, bool create);
+    void _putblock(memint idx, block*);
+
+    void _setop(const intset&, SetOp);
+
+    static integer _key(integer v)      { return v >> BLOCK_BITS; }
+    static lowint _low(integer v)       { return lowint(v & (BLOCK_SIZE - 1)); }
+
+public:
+    // Position of at() in the set, kept by the caller for sequential access;
+    // not valid after the set is modified
+    struct cursor
+    {
+        memint index, blk, rank, pos, posrank;
+        cursor(): index(-1), blk(0), rank(0), pos(0), posrank(0)  { }
+    };
+
+    intset() throw()                        : obj()  { }
+    intset(const intset& s) throw()         : obj(s.obj)  { }
+    intset(integer v) throw();
+    intset(integer l, integer r) throw();
+    ~intset() throw()                       { }
+    bool empty() const                      { return obj.empty() || obj->size == 0; }
+    memint size() const                     { return obj.empty() ? 0 : obj->size; }
+    memint compare(const intset& s) const;
+    bool operator== (const intset& s) const { return compare(s) == 0; }
+    bool operator!= (const intset& s) const { return compare(s) != 0; }
+    uinteger hash() const;
+    void clear()                            { obj.clear(); }
+    void operator= (const intset& s)        { obj = s.obj; }
+
+    bool find(integer v) const;
+    void find_insert(integer v);
+    void find_insert(integer l, integer h);
+    void find_erase(integer v);
+    integer at(memint i, cursor&) const;    // i-th smallest; fast for sequential access
+    integer at(memint i) const              { cursor c; return at(i, c); }
+    bool next(integer& v) const;            // smallest element >= v; false if none
+    void optimize();              // convert blocks to runs where possible
+
+    // Set operations, block by block
+    void unite(const intset& s)             { _setop(s, UNITE); }
+    void intersect(const intset& s)         { _setop(s, INTERSECT); }
+    void subtract(const intset& s)          { _setop(s, SUBTRACT); }
 };
 
 
@@ -993,7 +1257,7 @@ private:
 public:
     enum Type
         { VOID, ORD, REAL, VARPTR,
-          STR, RANGE, VEC, SET, ORDSET, DICT, REF, RTOBJ,
+          STR, RANGE, VEC, SET, ORDSET, INTSET, DICT, REF, RTOBJ,
           ANYOBJ = STR };
 
     struct _Void { int dummy; }; 
@@ -1040,6 +1304,7 @@ protected:
     void _init(const varvec& v) throw() { _init(VEC, v.obj); }
     void _init(const varset& v) throw() { _init(SET, v.obj); }
     void _init(const ordset& v) throw() { _init(ORDSET, v.obj); }
+    void _init(const intset& v) throw() { _init(INTSET, v.obj); }
     void _init(const vardict& v) throw() { _init(DICT, v.obj); }
     void _init(reference* o) throw();
     void _init(rtobject* o) throw()     { _init(RTOBJ, o); }
@@ -1066,8 +1331,9 @@ public:
     void clear() throw()                { _fin(); _init(); }
     bool empty() const;
 
-    memint compare(const variant&) const;
+    memint compare(const variant&) const;  // deep for vectors, sets and dicts
     bool operator== (const variant&) const;
+    uinteger hash() const;  // structural; cached in containers
     bool operator!= (const variant& v) const { return !(operator==(v)); }
 
     Type getType() const                { return Type(type); }
@@ -1088,6 +1354,7 @@ public:
     const varvec& _vec()          const { _dbg(VEC); return *(varvec*)&val._obj; }
     const varset& _set()          const { _dbg(SET); return *(varset*)&val._obj; }
     const ordset& _ordset()       const { _dbg(ORDSET); return *(ordset*)&val._obj; }
+    const intset& _intset()       const { _dbg(INTSET); return *(intset*)&val._obj; }
     const vardict& _dict()        const { _dbg(DICT); return *(vardict*)&val._obj; }
     reference*  _ref()            const { _dbg(REF); return CHKPTR(val._ref); }
     rtobject*   _rtobj()          const { _dbg(RTOBJ); return val._rtobj; }
@@ -1101,6 +1368,7 @@ public:
     varvec&     _vec()                  { _dbg(VEC); return *(varvec*)&val._obj; }
     varset&     _set()                  { _dbg(SET); return *(varset*)&val._obj; }
     ordset&     _ordset()               { _dbg(ORDSET); return *(ordset*)&val._obj; }
+    intset&     _intset()               { _dbg(INTSET); return *(intset*)&val._obj; }
     vardict&    _dict()                 { _dbg(DICT); return *(vardict*)&val._obj; }
 
     // Safer access methods; may throw
@@ -1113,6 +1381,7 @@ public:
     const varvec& as_vec()        const { _req(VEC); return _vec(); }
     const varset& as_set()        const { _req(SET); return _set(); }
     const ordset& as_ordset()     const { _req(ORDSET); return _ordset(); }
+    const intset& as_intset()     const { _req(INTSET); return _intset(); }
     const vardict& as_dict()      const { _req(DICT); return _dict(); }
     reference*  as_ref()          const { _req(REF); return val._ref; }
     rtobject*   as_rtobj()        const { _req(RTOBJ); return _rtobj(); }
@@ -1123,6 +1392,7 @@ public:
     varvec&     as_vec()                { _req(VEC); return _vec(); }
     varset&     as_set()                { _req(SET); return _set(); }
     ordset&     as_ordset()             { _req(ORDSET); return _ordset(); }
+    intset&     as_intset()             { _req(INTSET); return _intset(); }
     vardict&    as_dict()               { _req(DICT); return _dict(); }
 
     static void _type_err();
@@ -1212,6 +1482,7 @@ protected:
 #ifdef DEBUG
         pincrement(&object::allocated);
 #endif
+        PROF_ALLOC(s + extra * sizeof(variant));
         return pmemcalloc(s + extra * sizeof(variant));
     }
 
@@ -1278,6 +1549,20 @@ public:
 
 const int _varsize = int(sizeof(variant));
 
+class memfifo;
+
+
+// Serialization of runtime objects by fifo::bin_write() and bin_read();
+// the object variant is passed as is, both read and write go through the
+// same fifo.
+
+struct bincodec
+{
+    virtual ~bincodec()  { }
+    virtual void enq_obj(fifo&, const variant&) = 0;
+    virtual void deq_obj(fifo&, variant&) = 0;
+};
+
 
 // The abstract FIFO interface. There are 2 modes of operation: variant FIFO
 // and character FIFO. Destruction of variants is basically not handled by
@@ -1307,6 +1592,7 @@ protected:
     static void _rdonly_err();
     static void _fifo_type_err();
     static void _token_err();
+    static void _bin_err();
     void _req(bool req_char) const      { if (req_char != _is_char_fifo) _fifo_type_err(); }
     void _req_non_empty() const;
     void _req_non_empty(bool _char) const;
@@ -1320,12 +1606,37 @@ protected:
     virtual const char* get_tail(memint*);   // ... also return the length
     virtual void deq_bytes(memint);          // Discard n consecutive bytes returned by get_tail()
     virtual variant* enq_var();              // Reserve uninitialized space for a variant
+    virtual void commit_var();               // The variant reserved by enq_var() is now initialized
     virtual void enq_char(char);             // Push one char, char fifo only
     virtual memint enq_chars(const char*, memint); // Push arbitrary number of bytes, return actual number, char fifo only
 
+    // Optional, used by xfer(): file descriptors that can be read from or
+    // written to directly, bypassing the buffers, or -1; get_infd() returns
+    // a descriptor only if there is no buffered data, get_outfd() flushes;
+    // the number of bytes then transferred is reported via infd_read() and
+    // outfd_written()
+    virtual int get_infd();
+    virtual int get_outfd();
+    virtual void infd_read(memint);
+    virtual void outfd_written(memint);
+    virtual memfifo* get_memfifo();
+    // Char fifo: the char that follows the one at the tail, or -1 if there's
+    // none; nothing is consumed. The default looks only at the buffer returned
+    // by get_tail(), implementations that split their data should look past it.
+    virtual int peek_next();
+
     void _token(const charset& chars, str* result);
     void deq_var(variant*);  // dequeue variant to uninitialized area, for internal use
 
+    void _enq_fill(char, memint);
+    void _enq_uint(uinteger);
+    uchar _deq_byte();
+    uinteger _deq_uint();
+    memint _deq_count(memint max);
+    void _skip_raw(memint);
+    void _bin_enq(const variant&, bincodec* = NULL);
+    void _bin_deq(variant&, bincodec* = NULL);
+
 public:
     fifo(Type*, bool is_char) throw();
     ~fifo() throw();
@@ -1358,6 +1669,7 @@ public:
     void eat(const charset& c)          { _token(c, NULL); }
     void skip(const charset& c)         { eat(c); } // alias
     str  line();
+    bool next_line(str&);  // false on eof; reuses the string's buffer if possible
     bool eol();
     void skip_eol();
     bool eof() const                    { return empty(); }
@@ -1369,6 +1681,37 @@ public:
     void enq(uchar c)                   { enq_char(c); }
     void enq(large i);
     void enq(const varvec&);
+    // Formatted integer output, base 2 to 64. A negative width means left
+    // alignment; with '0' as the fill char the sign goes before the padding.
+    fifo& fmt(large, int width = 0, char fill = ' ', int base = 10);
+
+    // Integer input parsed directly from the buffers: an optional sign and
+    // digits in the given base (2 to 36, case-insensitive). Returns false if
+    // there is no number at the current position; nothing is consumed in
+    // that case. On overflow the digits are consumed and *overflow is set,
+    // similarly to from_string().
+    bool deq_int(integer* result, bool* overflow, int base = 10);
+    // Reads up to `count' integers into a packed vector, skipping any of
+    // the separator chars before each; stops at the end of data or at
+    // anything that isn't a number, returns the number of integers read.
+    // Throws on overflow.
+    memint deq_ints(podvec<integer>&, memint count, const charset& seps, int base = 10);
+
+    // Binary serialization of variants on character fifos. Each record is
+    // prefixed with its length so that it can be skipped without decoding.
+    void bin_enq(const variant&);
+    bool bin_deq(variant&);  // false on eof
+    bool bin_skip();         // false on eof
+    // Records without the length prefix; runtime objects, which can't be
+    // serialized otherwise, are passed to the codec (see heap images, vm.cpp)
+    void bin_write(const variant&, bincodec*);
+    void bin_read(variant&, bincodec*);
+
+    // Move all the remaining data to another character fifo without
+    // intermediate strings; between file descriptors the data is copied by
+    // the kernel, between memfifos the chunks are moved if possible.
+    // Returns the number of bytes transferred.
+    memint xfer(fifo& dest);
 
     fifo& operator<< (const char* s)    { enq(s); return *this; }
     fifo& operator<< (const str& s)     { enq(s); return *this; }
@@ -1387,42 +1730,51 @@ inline void variant::_init(fifo* f) throw() { _init(RTOBJ, f); }
 inline fifo* variant::_fifo() const  { return cast<fifo*>(CHKPTR(_rtobj())); }
 
 
-// The memfifo class implements a linked list of "chunks" in memory, where
-// each chunk is the size of 32 * sizeof(variant). Both enqueue and deqeue
-// operations are O(1), and memory usage is better than that of a plain linked 
-// list of elements, as "next" pointers are kept for bigger chunks of elements
-// rather than for each element. Can be used both for variants and chars. This
-// class "owns" variants, i.e. proper construction and desrtuction is done.
+// The memfifo class implements a linked list of "chunks" in memory. The first
+// chunk is the size of 32 * sizeof(variant), each subsequent one added while
+// the fifo is non-empty is twice the size of the previous one, up to
+// MAX_CHUNK_FACTOR * CHUNK_SIZE, so that fifos with high throughput or long
+// queues allocate less often. The last released chunk is kept for reuse,
+// therefore a fifo in steady state doesn't allocate at all. Both enqueue and
+// deqeue operations are O(1), and memory usage is better than that of a plain
+// linked list of elements, as "next" pointers are kept for bigger chunks of
+// elements rather than for each element. Can be used both for variants and
+// chars. This class "owns" variants, i.e. proper construction and
+// desrtuction is done.
 class memfifo: public fifo
 {
 public:
 #ifdef DEBUG
     static int CHUNK_SIZE; // settable from unit tests
+    enum { MAX_CHUNK_FACTOR = 64 };
 #else
-    enum { CHUNK_SIZE = 32 * _varsize };
+    enum { CHUNK_SIZE = 32 * _varsize, MAX_CHUNK_FACTOR = 64 };
 #endif
 
 protected:
     struct chunk: noncopyable
     {
         chunk* next;
+        int size;
         char data[0];
 #ifdef DEBUG
-        chunk() throw(): next(NULL)     { pincrement(&object::allocated); }
+        chunk(int s) throw(): next(NULL), size(s)  { pincrement(&object::allocated); }
         ~chunk() throw()                { pdecrement(&object::allocated); }
 #else
-        chunk() throw(): next(NULL)     { }
+        chunk(int s) throw(): next(NULL), size(s)  { }
 #endif
-        void* operator new(size_t)      { return ::pmemalloc(sizeof(chunk) + CHUNK_SIZE); }
+        void* operator new(size_t s, memint n)  { return ::pmemalloc(s + n); }
+        void operator delete(void* p, memint)   { ::pmemfree(p); }
         void operator delete(void* p)   { ::pmemfree(p); }
     };
 
     chunk* head;    // in
     chunk* tail;    // out
+    chunk* spare;   // last released chunk, reused by enq_chunk()
     int head_offs;
     int tail_offs;
 
-    void enq_chunk();
+    void enq_chunk(memint hint);
     void deq_chunk();
 
     // Overrides
@@ -1432,20 +1784,97 @@ protected:
     variant* enq_var();
     void enq_char(char);
     memint enq_chars(const char*, memint);
+    int peek_next();
 
     char* enq_space(memint);
     memint enq_avail();
+    memfifo* get_memfifo();
 
 public:
     memfifo(Type*, bool is_char) throw();
     ~memfifo() throw();
 
+    memint take(memfifo&);  // take over all chunks if empty, otherwise -1
+
     void clear();
     bool empty() const;     // override
     str get_name() const;   // override
 };
 
 
+#ifdef SHN_THR
+
+// Thread-safe fifo for exactly one producer and one consumer thread, e.g. for
+// pipelines. Like memfifo it's a list of chunks, however the two sides share
+// only the counter of committed bytes and the list of recycled chunks, both
+// updated atomically (GCC built-ins). The producer blocks when the fifo holds `capacity'
+// elements; the consumer blocks when it's empty, until the producer calls
+// close(). Both spin for a while before going to sleep.
+class pipefifo: public fifo
+{
+public:
+    enum { CHUNK_SIZE = 32 * _varsize, SPIN_COUNT = 1000 };
+
+protected:
+    struct chunk
+    {
+        chunk* next;
+        char data[CHUNK_SIZE];
+    };
+
+    enum { CONSUMER = 1, PRODUCER = 2 };
+
+    const memint capacity;      // in bytes
+    const memint elemsize;
+
+    // Producer's side
+    chunk* head;
+    memint head_offs;
+    chunk* spare;               // private list of recycled chunks
+
+    // Consumer's side
+    chunk* tail;
+    memint tail_offs;
+
+    // Shared, accessed atomically
+    memint count;               // committed bytes
+    chunk* recycled;            // chunks returned by the consumer
+    bool closed;
+    int waiting;                // CONSUMER and/or PRODUCER
+    mutex mtx;
+    condvar cond;
+
+    memint get_count() const    { return __atomic_load_n(&count, __ATOMIC_ACQUIRE); }
+
+    chunk* new_chunk();
+    char* enq_space(memint);
+    void commit(memint);
+    void wait_for(int who, memint need = 1);
+    void wake_up(int who);
+    bool ready(int who, memint need) const;
+
+    // Overrides
+    const char* get_tail();
+    const char* get_tail(memint*);
+    void deq_bytes(memint);
+    variant* enq_var();
+    void commit_var();
+    void enq_char(char);
+    memint enq_chars(const char*, memint);
+    int peek_next();
+
+public:
+    pipefifo(Type*, bool is_char, memint capacity) throw();
+    ~pipefifo() throw();
+
+    bool empty() const;     // override; blocks until there's data or close()
+    str get_name() const;   // override
+    void close();           // called by the producer when done
+};
+
+#endif
+
+
 // Buffer read event handler (write events aren't implemented yet)
 class bufevent: public object
 {
@@ -1514,6 +1943,47 @@ public:
 };
 
 
+// Variant fifos on top of a character fifo (e.g. a file) that holds the
+// values in the binary format, see fifo::bin_enq(). varinfifo is read-only
+// and varoutfifo is write-only.
+class varinfifo: public fifo
+{
+protected:
+    objptr<fifo> source;
+    podvar slot;
+    bool loaded;
+
+    const char* get_tail();
+    const char* get_tail(memint*);
+    void deq_bytes(memint);
+
+public:
+    varinfifo(Type*, fifo* source) throw();
+    ~varinfifo() throw();
+
+    bool empty() const;     // override
+    str get_name() const;   // override
+};
+
+
+class varoutfifo: public fifo
+{
+protected:
+    objptr<fifo> dest;
+    podvar slot;
+    bool pending;   // slot holds a variant that hasn't been committed
+
+    variant* enq_var();
+    void commit_var();
+
+public:
+    varoutfifo(Type*, fifo* dest) throw();
+    ~varoutfifo() throw();
+
+    str get_name() const;   // override
+};
+
+
 // TODO: varfifo, a variant vector wrapper based on buffifo
 
 class intext: public buffifo
@@ -1521,8 +1991,9 @@ class intext: public buffifo
 public:
 #ifdef DEBUG
     static int BUF_SIZE; // settable from unit tests
+    static int MMAP_MIN;
 #else
-    enum { BUF_SIZE = 4096 * sizeof(integer) };
+    enum { BUF_SIZE = 4096 * sizeof(integer), MMAP_MIN = 64 * 1024 };
 #endif
 
 protected:
@@ -1530,10 +2001,16 @@ protected:
     str  filebuf;
     int  _fd;
     bool _eof;
+    char* _map;         // regular files of at least MMAP_MIN bytes are mapped
+    memint _mapsize;
 
     void error(int code); // throws esyserr
     void doopen();
+    void domap();
     void doread();
+    int get_infd();     // override
+    void infd_read(memint n)        { buforig += n; }   // override
+    int peek_next();    // override
 
 public:
     intext(Type*, const str& fn) throw();
@@ -1545,6 +2022,44 @@ public:
 };
 
 
+#ifdef SHN_THR
+
+// Background writer used by outtext in asynchronous mode: filled buffers are
+// queued and written to the file by a separate thread, while the caller
+// continues with a free buffer. A write error is reported by the next call
+// to put() or finish().
+class outwriter: public object, protected thread
+{
+protected:
+    int fd;
+    int count;          // total number of buffers
+    char** bufs;        // all buffers
+    char** freebufs;    // stack of free buffers
+    int nfree;
+    char** qbufs;       // ring queue of filled buffers
+    memint* qsizes;
+    int qhead, queued;
+    int pending;        // queued or being written
+    bool stopping;
+    int err;
+    mutex mtx;
+    condvar cond;
+
+    void execute();
+
+public:
+    outwriter(memint bufsize, int count) throw();
+    ~outwriter() throw();
+
+    char* get_free();                           // the first free buffer
+    int put(int fd, char* buf, memint size, char** next);   // returns errno
+    int drain();                                // waits for all writes; returns errno
+    int finish();                               // returns errno
+};
+
+#endif
+
+
 class outtext: public buffifo
 {
 protected:
@@ -1554,8 +2069,14 @@ protected:
     str  filebuf;
     int  _fd;
     bool _err;
+#ifdef SHN_THR
+    objptr<outwriter> _writer;
+#endif
 
     void error(int code); // throws esyserr
+    void doopen();
+    int get_outfd();    // override
+    void outfd_written(memint n)    { buforig += n; }   // override
 
 public:
     outtext(Type*, const str& fn) throw();
@@ -1564,30 +2085,57 @@ public:
     void flush();           // override
     str get_name() const;   // override
     void open()             { flush(); /* attempt to open */ }
+    void sync();            // flush and wait for async writes; throws pending errors
+    // Number of buffers for asynchronous writing, 2 for double buffering;
+    // 0 or 1 means synchronous writes (default); no effect without SHN_THR
+    void set_async(int buffers);
 };
 
 
 // Standard input/output object, a two-way fifo. In case of stderr it is write-only.
+// Output is buffered according to the buffering mode; in any case it is
+// flushed at exit and before reading from the same stdfile.
 class stdfile: public intext
 {
+public:
+    enum BufMode { UNBUFFERED, LINE_BUFFERED, FULLY_BUFFERED,
+        AUTO_BUFFERED };  // line-buffered if the output is a terminal
+
 protected:
+    enum { OBUF_SIZE = 2048 * sizeof(integer) };
+
     int _ofd;
+    BufMode _omode;
+    char* _obuf;
+    memint _ohead;
+
     void enq_char(char);
     memint enq_chars(const char*, memint);
+    void dowrite(const char*, memint);
+    int get_outfd();    // override
+
 public:
-    stdfile(int infd, int outfd) throw();
+    stdfile(int infd, int outfd, BufMode) throw();
     ~stdfile() throw();
+
+    bool empty() const;     // override
+    void flush();           // override
+    void set_bufmode(BufMode);
 };
 
 
 extern stdfile sio;
 extern stdfile serr;
 
+void flushStdFiles();  // ignores errors; installed as fatalHook
+
 
 // System utilities
 
 
 bool isFile(const char*);
+str canonicalPath(const str&);  // absolute, with symlinks resolved; or as is if not found
+bool getFileStamp(const char*, large* mtime, large* size); // false if not found
 
 
 // ------------------------------------------------------------------------- //
@@ -26,6 +26,12 @@ void compileToken(Compiler* c, Builtin*)
     { c->codegen->fifoToken(); }
 
 
+// lines(f) leaves the fifo as is: iterating over a char fifo in a 'for'
+// loop yields its lines; the builtin only makes it explicit
+void compileLines(Compiler*, Builtin*)
+    { }
+
+
 void compileSkip(Compiler* c, Builtin* b)
 {
     // TODO: maybe more possibilities, e.g. skip(n), skip({...}) for any fifo
@@ -74,6 +80,54 @@ void shn_look(variant* result, stateobj*, variant args[])
     new(result) variant((uchar)args[-1]._fifo()->look());
 }
 
+
+void shn_xfer(variant* result, stateobj*, variant args[])
+{
+    new(result) variant(integer(args[-2]._fifo()->xfer(*args[-1]._fifo())));
+}
+
+
+void shn_flush(variant*, stateobj*, variant args[])
+{
+    args[-1]._fifo()->flush();
+}
+
+
+void shn_fmt(variant* result, stateobj*, variant args[])
+{
+    fifo* f = args[-5]._fifo();
+    f->fmt(args[-4]._int(), int(args[-3]._int()), args[-2]._uchar(), int(args[-1]._int()));
+    new(result) variant(f);
+}
+
+
+static charset numSeps = charset(" \t\r\n,");
+
+
+void shn_readint(variant* result, stateobj*, variant args[])
+{
+    fifo* f = args[-2]._fifo();
+    f->skip(numSeps);
+    integer value;
+    bool overflow;
+    if (!f->deq_int(&value, &overflow, int(args[-1]._int())))
+        throw efifo("Number expected");
+    if (overflow)
+        throw efifo("Numeric overflow");
+    new(result) variant(value);
+}
+
+
+void shn_readints(variant* result, stateobj*, variant args[])
+{
+    podvec<integer> values;
+    args[-3]._fifo()->deq_ints(values, args[-2]._int(), numSeps, int(args[-1]._int()));
+    varvec v;
+    for (memint i = 0; i < values.size(); i++)
+        v.push_back(values[i]);
+    new(result) variant(v);
+}
+
 void shn_strfifo(variant* result, stateobj*, variant args[])
 {
     new(result) variant(new strfifo(queenBee->defCharFifo, args[-1]._str()));
@@ -22,12 +22,18 @@ void compileEnq(Compiler*, Builtin*);
 void compileDeq(Compiler*, Builtin*);
 void compileToken(Compiler*, Builtin*);
 void compileSkip(Compiler*, Builtin*);
+void compileLines(Compiler*, Builtin*);
 
 void shn_skipset(variant*, stateobj*, variant[]);
 void shn_eol(variant*, stateobj*, variant[]);
 void shn_line(variant*, stateobj*, variant[]);
 void shn_skipln(variant*, stateobj*, variant[]);
 void shn_look(variant*, stateobj*, variant[]);
+void shn_xfer(variant*, stateobj*, variant[]);
+void shn_flush(variant*, stateobj*, variant[]);
+void shn_fmt(variant*, stateobj*, variant[]);
+void shn_readint(variant*, stateobj*, variant[]);
+void shn_readints(variant*, stateobj*, variant[]);
 
 void shn_strfifo(variant*, stateobj*, variant[]);
 
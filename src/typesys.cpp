@@ -154,6 +154,13 @@ void Scope::replaceSymbol(Symbol* s)
 }
 
 
+Symbol* Scope::find(const str& ident, memint visible) const
+{
+    memint i = symbols.index_of(ident);
+    return i >= 0 && i < visible ? cast<Symbol*>(symbols[i]) : NULL;
+}
+
+
 Symbol* Scope::findShallow(const str& ident) const
 {
     Symbol* s = find(ident);
@@ -226,6 +233,9 @@ bool Type::isByteVec() const
 bool Type::isByteSet() const
     { return isAnySet() && PContainer(this)->hasByteIndex(); }
 
+bool Type::isIntSet() const
+    { return isAnySet() && PContainer(this)->index->isAnyOrd() && !PContainer(this)->hasByteIndex(); }
+
 bool Type::isByteDict() const
     { return isAnyDict() && PContainer(this)->hasByteIndex(); }
 
@@ -245,6 +255,15 @@ bool Type::isVectorOf(Type* elem) const
 bool Type::identicalTo(Type* t) const
     { return t == this; }
 
+bool Type::isInternedWith(Type* t) const
+{
+    // Containers and fifos are interned per module and against the system
+    // module (see State::getContainerType()), so two distinct ones can only
+    // be identical if they come from two different user modules
+    return host != NULL && t->host != NULL
+        && (host == t->host || host == queenBee || t->host == queenBee);
+}
+
 bool Type::canAssignTo(Type* t) const
     { return identicalTo(t); }
 
@@ -260,8 +279,9 @@ bool Type::isCompatibleWith(const variant& v)
         case variant::STR:      return isByteVec();
         case variant::RANGE:    return isRange();
         case variant::VEC:      return (isAnyVec() && !isByteVec()) || isByteDict();
-        case variant::SET:      return isAnySet() && !isByteSet();
+        case variant::SET:      return isAnySet() && !isByteSet() && !isIntSet();
         case variant::ORDSET:   return isByteSet();
+        case variant::INTSET:   return isIntSet();
         case variant::DICT:     return isAnyDict() && !isByteDict();
         case variant::REF:      return isReference();
         case variant::RTOBJ:
@@ -342,7 +362,6 @@ Fifo* Type::deriveFifo(State* h)
     if (isFullChar())
         return queenBee->defCharFifo;
     else
-        // TODO: lookup existing fifo types in h
         return h->getFifoType(this);
 }
 
@@ -397,6 +416,18 @@ static void dumpOrdDict(fifo& stm, const varvec& v, Type* keyType = NULL, Type*
 }
 
 
+static void dumpIntSet(fifo& stm, const intset& s, Type* elemType = NULL)
+{
+    stm << '{';
+    for (memint i = 0; i < s.size(); i++)
+    {
+        if (i) stm << ", ";
+        dumpVariant(stm, s.at(i), elemType);
+    }
+    stm << '}';
+}
+
+
 static void dumpOrdSet(fifo& stm, const ordset& s, Ordinal* elemType = NULL)
 {
     stm << '{';
@@ -462,6 +493,7 @@ void dumpVariant(fifo& stm, const variant& v, Type* type)
             case variant::VEC:      dumpVec(stm, v._vec(), false); break;
             case variant::SET:      dumpVec(stm, v._set(), true); break;
             case variant::ORDSET:   dumpOrdSet(stm, v._ordset()); break;
+            case variant::INTSET:   dumpIntSet(stm, v._intset()); break;
             case variant::DICT:     dumpDict(stm, v._dict()); break;
             case variant::REF:      stm << '@'; dumpVariant(stm, v._ref()->var); break;
             case variant::RTOBJ:    if (v._rtobj()) v._rtobj()->dump(stm); else stm << "{}"; break;
@@ -669,7 +701,7 @@ void Range::dumpValue(fifo& stm, const variant& v) const
 
 
 bool Range::identicalTo(Type* t) const
-    { return t->isRange() && elem->identicalTo(PRange(t)->elem); }
+    { return this == t || (t->isRange() && elem->identicalTo(PRange(t)->elem)); }
 
 bool Range::canAssignTo(Type* t) const
     { return t->isRange() && elem->canAssignTo(PRange(t)->elem); }
@@ -728,6 +760,8 @@ void Container::dumpValue(fifo& stm, const variant& v) const
     {
         if (isByteSet())
             dumpOrdSet(stm, v.as_ordset(), POrdinal(index));
+        else if (isIntSet())
+            dumpIntSet(stm, v.as_intset(), index);
         else
             dumpVec(stm, v.as_set(), true, index);
     }
@@ -745,7 +779,7 @@ void Container::dumpValue(fifo& stm, const variant& v) const
 
 bool Container::identicalTo(Type* t) const
 {
-    return this == t || (t->isAnyCont()
+    return this == t || (t->isAnyCont() && !isInternedWith(t)
         && elem->identicalTo(PContainer(t)->elem)
         && index->identicalTo(PContainer(t)->index));
 }
@@ -767,7 +801,8 @@ void Fifo::dump(fifo& stm) const
 
 
 bool Fifo::identicalTo(Type* t) const
-    { return this == t || (t->isAnyFifo() && elem->identicalTo(PFifo(t)->elem)); }
+    { return this == t || (t->isAnyFifo() && !isInternedWith(t)
+        && elem->identicalTo(PFifo(t)->elem)); }
 
 
 // --- Prototype ----------------------------------------------------------- //
@@ -863,9 +898,17 @@ bool SelfStub::canAssignTo(Type*) const
 // --- State --------------------------------------------------------------- //
 
 
+PendingBody::PendingBody() throw()
+    : object()  { }
+
+
+PendingBody::~PendingBody() throw()
+    { }
+
+
 State::State(State* par, FuncPtr* proto, State* b) throw()
     : Type(STATE), Scope(par),
-      complete(false), innerObjUsed(0), outsideObjectsUsed(0),
+      complete(false), bodyDeferred(false), bodyCompiling(false), innerObjUsed(0), outsideObjectsUsed(0),
       parent(par), parentModule(getParentModule(this)),
       prototype(proto), resultVar(NULL),
       codeseg(new CodeSeg(this)), externFunc(NULL), base(b),
@@ -874,7 +917,7 @@ State::State(State* par, FuncPtr* proto, State* b) throw()
 
 State::State(State* par, FuncPtr* proto, ExternFuncProto func, State* b) throw()
     : Type(STATE), Scope(par),
-      complete(true), innerObjUsed(0), outsideObjectsUsed(0),
+      complete(true), bodyDeferred(false), bodyCompiling(false), innerObjUsed(0), outsideObjectsUsed(0),
       parent(par), parentModule(getParentModule(this)),
       prototype(proto), resultVar(NULL),
       codeseg(), externFunc(func), base(b),
@@ -919,6 +962,35 @@ State::~State() throw()
 }
 
 
+void State::_compileBody()
+{
+#ifdef SHN_THR
+    // The body stays pending until it's compiled, so that another thread
+    // that requests it waits here rather than using an incomplete state.
+    // The lock is taken on every request, even once the body is compiled:
+    // it's what makes the compiled state visible to this thread. The lock
+    // is per module: modules don't wait for each other, and since modules
+    // can't use each other circularly, neither can they deadlock.
+    scopelock lock(parentModule->bodyLock);
+#endif
+    // The function may refer to itself
+    if (bodyCompiling || !isPending())
+        return;
+    bodyCompiling = true;
+    try
+    {
+        pendingBody->compile(this);
+    }
+    catch (exception&)
+    {
+        bodyCompiling = false;
+        throw;
+    }
+    bodyCompiling = false;
+    pendingBody.clear();
+}
+
+
 void State::fqName(fifo& stm) const
 {
     if (parent)
@@ -1020,6 +1092,20 @@ Type* State::_registerType(Type* t, Definition* d) throw()
 }
 
 
+void State::listStates(podvec<State*>& list) const
+{
+    for (memint i = 0; i < types.size(); i++)
+    {
+        Type* t = types[i];
+        if (t->isAnyState() && t->host == this)
+        {
+            list.push_back(cast<State*>(t));
+            cast<State*>(t)->listStates(list);
+        }
+    }
+}
+
+
 Definition* State::addDefinition(const str& n, Type* t, const variant& v, Scope* scope)
 {
     if (n.empty())
@@ -1102,30 +1188,38 @@ stateobj* State::newInstance()
 }
 
 
+// Derived types are registered with the module rather than with the state
+// that requested them, so that identical derivations within a module, as
+// well as those found in the system module, are the same object, and
+// identicalTo() can tell them apart by address. Derivations made by two
+// different user modules are separate objects compared structurally.
+
 Container* State::getContainerType(Type* idx, Type* elem)
 {
     assert(!idx->isReference());
-    // TODO: replace linear search with something faster?
-    for (memint i = 0; i < types.size(); i++)
+    Container* c = parentModule->derivedTypes.findContainer(idx, elem);
+    if (c == NULL && queenBee != NULL && parentModule != queenBee)
+        c = queenBee->derivedTypes.findContainer(idx, elem);
+    if (c == NULL)
     {
-        Type* t = types[i];
-        if (t->isContainer(idx, elem))
-            return PContainer(t);
+        c = parentModule->registerType(new Container(idx, elem));
+        parentModule->derivedTypes.add(c);
     }
-    return registerType(new Container(idx, elem));
+    return c;
 }
 
 
 Fifo* State::getFifoType(Type* elem)
 {
-    // TODO: replace linear search with something faster?
-    for (memint i = 0; i < types.size(); i++)
+    Fifo* f = parentModule->derivedTypes.findFifo(elem);
+    if (f == NULL && queenBee != NULL && parentModule != queenBee)
+        f = queenBee->derivedTypes.findFifo(elem);
+    if (f == NULL)
     {
-        Type* t = types[i];
-        if (t->isFifo(elem))
-            return PFifo(t);
+        f = parentModule->registerType(new Fifo(elem));
+        parentModule->derivedTypes.add(f);
     }
-    return registerType(new Fifo(elem));
+    return f;
 }
 
 
@@ -1151,11 +1245,106 @@ FuncPtr* State::registerProto(Type* ret, Type* arg1, Type* arg2)
 }
 
 
+// --- TypeIndex ----------------------------------------------------------- //
+
+
+// Structural hash consistent with identicalTo(): identical types always have
+// equal hashes. Types that are only identical to themselves (states,
+// enumerations) are hashed by address.
+
+static uinteger typeHash(Type*);
+
+static uinteger contHash(Type* idx, Type* elem)
+    { return _hashmix(_hashmix(Type::VEC, typeHash(idx)), typeHash(elem)); }
+
+static uinteger fifoHash(Type* elem)
+    { return _hashmix(Type::FIFO, typeHash(elem)); }
+
+static uinteger typeHash(Type* t)
+{
+    if (t->isAnyCont())
+        return contHash(PContainer(t)->index, PContainer(t)->elem);
+    else if (t->isAnyFifo())
+        return fifoHash(PFifo(t)->elem);
+    else if (t->isEnum() || t->isAnyState())
+        return uinteger(t);
+    else if (t->isAnyOrd())
+        return _hashmix(_hashmix(t->typeId, POrdinal(t)->left), POrdinal(t)->right);
+    else if (t->isReference())
+        return _hashmix(t->typeId, typeHash(PReference(t)->to));
+    else if (t->isRange())
+        return _hashmix(t->typeId, typeHash(PRange(t)->elem));
+    else if (t->typeId == Type::SELFSTUB)
+        t->identicalTo(t);  // throws, same as any comparison with 'self' would
+    return t->typeId;
+}
+
+
+TypeIndex::TypeIndex() throw()
+    : slots(NULL), capacity(0), count(0)  { }
+
+
+TypeIndex::~TypeIndex() throw()
+    { pmemfree(slots); }
+
+
+Container* TypeIndex::findContainer(Type* idx, Type* elem) const
+{
+    if (count == 0)
+        return NULL;
+    for (memint i = contHash(idx, elem) & (capacity - 1); slots[i]; i = (i + 1) & (capacity - 1))
+        if (slots[i]->isContainer(idx, elem))
+            return PContainer(slots[i]);
+    return NULL;
+}
+
+
+Fifo* TypeIndex::findFifo(Type* elem) const
+{
+    if (count == 0)
+        return NULL;
+    for (memint i = fifoHash(elem) & (capacity - 1); slots[i]; i = (i + 1) & (capacity - 1))
+        if (slots[i]->isFifo(elem))
+            return PFifo(slots[i]);
+    return NULL;
+}
+
+
+void TypeIndex::add(Type* t)
+{
+    assert(t->isAnyCont() || t->isAnyFifo());
+    if ((count + 1) * 2 > capacity)
+        grow();
+    memint i = typeHash(t) & (capacity - 1);
+    while (slots[i])
+        i = (i + 1) & (capacity - 1);
+    slots[i] = t;
+    count++;
+}
+
+
+void TypeIndex::grow()
+{
+    Type** old = slots;
+    memint oldcap = capacity;
+    capacity = imax<memint>(capacity * 2, 16);
+    slots = (Type**)pmemcalloc(capacity * sizeof(Type*));
+    count = 0;
+    for (memint i = 0; i < oldcap; i++)
+        if (old[i])
+            add(old[i]);
+    pmemfree(old);
+}
+
+
 // --- Module -------------------------------------------------------------- //
 
 
 Module::Module(const str& n, const str& f) throw()
     : State(NULL, new FuncPtr(this)), filePath(f)
+#ifdef SHN_THR
+      , bodyLock(true)
+#endif
 {
     defName = n;
     registerType(prototype);
@@ -1203,15 +1392,8 @@ void Module::registerString(str& s)
 {
     if (s.empty())
         return;
+    strPool.intern(s);
     constStrings.push_back(s);
-    // TODO: make finding duplicates a compiler option?
-/*
-    memint i;
-    if (constStrings.bsearch(s, i))
-        s = constStrings[i];
-    else
-        constStrings.insert(i, s);
-*/
 }
 
 
@@ -1251,6 +1433,10 @@ QueenBee::QueenBee()
     addTypeAlias("chars", defCharSet);
     addTypeAlias("charf", registerType(defCharFifo)->getRefType());
     addTypeAlias("self", defSelfStub);
+    derivedTypes.add(defNullCont);
+    derivedTypes.add(defStr);
+    derivedTypes.add(defCharSet);
+    derivedTypes.add(defCharFifo);
 
     // Constants
     addDefinition("__VER_MAJOR", defInt, SHANNON_VERSION_MAJOR, this);
@@ -1259,6 +1445,7 @@ QueenBee::QueenBee()
 
     // Variables
     resultVar = addInnerVar("__program_result", defVariant);
+    argsVar = addInnerVar("__program_args", defVariant);
     sioVar = addInnerVar("sio", defCharFifo);
     serrVar = addInnerVar("serr", defCharFifo);
 
@@ -1266,7 +1453,7 @@ QueenBee::QueenBee()
     // NULL argument means anything goes, the builtin parser will take care of 
     // type checking. Return type doesn't matter; the builtin parser functions
     // leave the actual result types on the simulation stack anyway.
-    // TODO: fmt() read() write()
+    // TODO: read() write()
     // TODO: infile() outfile()
     FuncPtr* proto1 = registerProto(defVariant, NULL);
     FuncPtr* proto2 = registerProto(defVariant, NULL, NULL);
@@ -1288,6 +1475,29 @@ QueenBee::QueenBee()
         registerState(registerProto(defVoid, defCharFifo), shn_skipln));
     addBuiltin("look", NULL,
         registerState(registerProto(defChar, defCharFifo), shn_look));
+    addBuiltin("lines", compileLines, registerProto(defCharFifo, defCharFifo));
+    addBuiltin("xfer", NULL,
+        registerState(registerProto(defInt, defCharFifo, defCharFifo), shn_xfer));
+    addBuiltin("flush", NULL,
+        registerState(registerProto(defVoid, defCharFifo), shn_flush));
+
+    // fmt(fifo, int, width = 0, fill = ' ', base = 10)
+    FuncPtr* fmtProto = registerProto(defCharFifo, defCharFifo, defInt);
+    variant fmtWidth = integer(0), fmtFill = integer(' '), fmtBase = integer(10);
+    fmtProto->addFormalArg("", defInt, false, &fmtWidth);
+    fmtProto->addFormalArg("", defChar, false, &fmtFill);
+    fmtProto->addFormalArg("", defInt, false, &fmtBase);
+    addBuiltin("fmt", NULL, registerState(fmtProto, shn_fmt));
+
+    // readint(fifo, base = 10), readints(fifo, count, base = 10); numbers
+    // can be separated by whitespace and commas
+    variant defBase = integer(10);
+    FuncPtr* readintProto = registerProto(defInt, defCharFifo);
+    readintProto->addFormalArg("", defInt, false, &defBase);
+    addBuiltin("readint", NULL, registerState(readintProto, shn_readint));
+    FuncPtr* readintsProto = registerProto(getContainerType(defVoid, defInt), defCharFifo, defInt);
+    readintsProto->addFormalArg("", defInt, false, &defBase);
+    addBuiltin("readints", NULL, registerState(readintsProto, shn_readints));
 
     addTypeAlias("strfifo",
         registerState(registerProto(defCharFifo, defStr), shn_strfifo));
@@ -1306,8 +1516,6 @@ stateobj* QueenBee::newInstance()
     assert(getCodeSeg()->closed);
     assert(complete);
     stateobj* inst = parent::newInstance();
-    sio.setType(defCharFifo);
-    serr.setType(defCharFifo);
     *inst->member(sioVar->id) = &sio;
     *inst->member(serrVar->id) = &serr;
     return inst;
@@ -1349,8 +1557,15 @@ objptr<Void> defVoid;
 objptr<QueenBee> queenBee;
 
 
+static initcount typeSysInit;
+
+
 void initTypeSys()
 {
+    initscope init(typeSysInit, true);
+    if (!init.needed())
+        return;
+
     // Because all Type objects are also runtime objects, they all have a
     // runtime type of "type reference". The initial typeref object refers to
     // itself and should be created before anything else in the type system.
@@ -1364,13 +1579,24 @@ void initTypeSys()
     // recursive definitions and other kinds of weirdness, and therefore should
     // be defined in C code rather than in Shannon code
     queenBee = new QueenBee();
+
+    // The standard fifos are shared by all contexts unless a context
+    // provides its own, see Context::setStdStreams()
+    sio.setType(queenBee->defCharFifo);
+    serr.setType(queenBee->defCharFifo);
 }
 
 
 void doneTypeSys()
 {
+    initscope done(typeSysInit, false);
+    if (!done.needed())
+        return;
+    sio.clearType();
+    serr.clearType();
     queenBee = NULL;
     defVoid = NULL;
     defTypeRef = NULL;
+    strPool.purge();
 }
 
@@ -207,7 +207,10 @@ public:
     void replaceSymbol(Symbol*);
     Symbol* find(const str& ident) const            // returns NULL or Symbol
         { return symbols.find(ident); }
+    Symbol* find(const str& ident, memint visible) const; // only among the first `visible' symbols
     Symbol* findShallow(const str& _name) const;    // throws EUnknown
+    memint symbolCount() const
+        { return symbols.size(); }
 };
 
 
@@ -258,6 +261,7 @@ protected:
 
     Type(TypeId) throw();
     static TypeId contType(Type* i, Type* e) throw();
+    bool isInternedWith(Type*) const;
     // void setTypeId(TypeId id)
     //     { const_cast<TypeId&>(typeId) = id; }
 
@@ -289,6 +293,7 @@ public:
     bool isAnyCont() const      { return typeId >= NULLCONT && typeId <= DICT; }
     bool isByteVec() const;
     bool isByteSet() const;
+    bool isIntSet() const;
     bool isByteDict() const;
     bool isContainer(Type* idx, Type* elem) const;
     bool isVectorOf(Type* elem) const;
@@ -545,9 +550,41 @@ public:
 };
 
 
+// --- TypeIndex ----------------------------------------------------------- //
+
+
+// Hash index of derived container and fifo types keyed by their structure,
+// so that identical derivations are found in O(1); doesn't own the types.
+class TypeIndex: noncopyable
+{
+protected:
+    Type** slots;   // open addressing, linear probing
+    memint capacity;
+    memint count;
+    void grow();
+public:
+    TypeIndex() throw();
+    ~TypeIndex() throw();
+    Container* findContainer(Type* idx, Type* elem) const;
+    Fifo* findFifo(Type* elem) const;
+    void add(Type*);
+};
+
+
 // --- State --------------------------------------------------------------- //
 
 
+// Interface for compiling a function body on demand, see State::compileBody();
+// implemented by the compiler
+class PendingBody: public object
+{
+public:
+    PendingBody() throw();
+    ~PendingBody() throw();
+    virtual void compile(State*) = 0;
+};
+
+
 typedef void (*ExternFuncProto)(variant* result, stateobj* outerobj, variant args[]);
 
 // "i" below is 1-based; arguments are numbered from right to left
@@ -567,9 +604,13 @@ protected:
     void _setup();
     InnerVar* addInnerVar(InnerVar*);
     static Module* getParentModule(State*) throw();
+    void _compileBody();
 
     // Compiler helpers:
     bool complete;
+    bool bodyDeferred;              // set before the module is complete, never cleared
+    bool bodyCompiling;             // see _compileBody()
+    objptr<PendingBody> pendingBody; // the body hasn't been compiled yet
     int innerObjUsed;
     int outsideObjectsUsed;
 
@@ -606,6 +647,12 @@ public:
         { assert(complete); return innerObjUsed; }
     bool isExternal() const
         { return externFunc != NULL; }
+    bool isPending() const
+        { return pendingBody.get() != NULL; }
+    void deferBody(PendingBody* b)
+        { assert(!complete); pendingBody = b; bodyDeferred = true; }
+    void compileBody()
+        { if (bodyDeferred) _compileBody(); }
     void useInnerObj()
         { innerObjUsed++; }
     void useOutsideObject()
@@ -629,6 +676,7 @@ public:
     FuncPtr* registerProto(Type* ret);
     FuncPtr* registerProto(Type* ret, Type* arg1);
     FuncPtr* registerProto(Type* ret, Type* arg1, Type* arg2);
+    void listStates(podvec<State*>&) const;  // nested states, recursively
     CodeSeg* getCodeSeg() const;
     const uchar* getCodeStart() const;
 };
@@ -657,6 +705,10 @@ protected:
 public:
     str const filePath;
     objvec<InnerVar> usedModuleVars; // used module instances are stored in static vars
+    TypeIndex derivedTypes;         // shared by all states of the module
+#ifdef SHN_THR
+    mutex bodyLock;                 // see State::_compileBody()
+#endif
     Module(const str& name, const str& filePath) throw();
     ~Module() throw();
     void dump(fifo&) const;
@@ -699,6 +751,7 @@ public:
     Variable* sioVar;
     Variable* serrVar;
     Variable* resultVar;
+    Variable* argsVar;
     Builtin* findBuiltin(const str& ident)  // returns Builtin* or NULL
         { return builtinScope.find(ident); }
 };
@@ -37,18 +37,18 @@ static void localObjErr()
     { throw emessage("Local object is locked"); }
 
 
-static void dumpVar(const str& expr, const variant& var, Type* type)
+static void dumpVar(fifo& f, const str& expr, const variant& var, Type* type)
 {
     // TODO: dump to serr?
-    sio << "# " << expr;
+    f << "# " << expr;
     if (type)
     {
-        sio << ": ";
-        type->dumpDef(sio);
+        f << ": ";
+        type->dumpDef(f);
     }
-    sio << " = ";
-    dumpVariant(sio, var, type);
-    sio << endl;
+    f << " = ";
+    dumpVariant(f, var, type);
+    f << endl;
 }
 
 
@@ -150,6 +150,10 @@ void runRabbitRun(variant* result, stateobj* dataseg, stateobj* outerobj,
 
     variant* stk = basep - 1;
 
+#ifdef SHN_PROFILE
+    allocprof::scope profScope(state);
+#endif
+
     // Function call helpers:
     variant ax; // accumulator register, for function results
     State* callee;
@@ -544,8 +548,10 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
             { varset s; s.push_back(*stk); *stk = s; }
             break;
         case opSetAddElem:
-            (stk - 1)->_set().find_insert(*stk);
-            POP();
+            if ((stk - 1)->is(variant::INTSET))
+                { (stk - 1)->_intset().find_insert(stk->_int()); POPPOD(); }
+            else
+                { (stk - 1)->_set().find_insert(*stk); POP(); }
             break;
         case opElemToByteSet:
             *stk = ordset(stk->_int());
@@ -563,8 +569,23 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
             POPPOD();
             POPPOD();
             break;
+        case opElemToIntSet:
+            *stk = intset(stk->_int());
+            break;
+        case opRngToIntSet:
+            *(stk - 1) = intset((stk - 1)->_int(), stk->_int());
+            POPPOD();
+            break;
+        case opIntSetAddRng:
+            (stk - 2)->_intset().find_insert((stk - 1)->_int(), stk->_int());
+            POPPOD();
+            POPPOD();
+            break;
         case opInSet:
-            *(stk - 1) = int(stk->_set().find(*(stk - 1)));
+            if (stk->is(variant::INTSET))
+                (stk - 1)->_int() = int(stk->_intset().find((stk - 1)->_int()));
+            else
+                *(stk - 1) = int(stk->_set().find(*(stk - 1)));
             POP();
             break;
         case opInByteSet:
@@ -600,7 +621,13 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
             POPPOD(); POP(); PUSH0();
             break;
         case opDelSetElem:     // -var -ptr -obj
-            (stk - 1)->_ptr()->_set().find_erase(*stk);
+            {
+                variant* s = (stk - 1)->_ptr();
+                if (s->is(variant::INTSET))
+                    s->_intset().find_erase(stk->_int());
+                else
+                    s->_set().find_erase(*stk);
+            }
             POP(); POPPOD(); POP();
             break;
         case opDelByteSetElem:     // -int -ptr -obj
@@ -608,10 +635,16 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
             POPPOD(); POPPOD(); POP();
             break;
         case opSetLen:
-            *stk = integer(stk->_set().size());
+            if (stk->is(variant::INTSET))
+                *stk = integer(stk->_intset().size());
+            else
+                *stk = integer(stk->_set().size());
             break;
         case opSetKey:
-            *(stk - 1) = (stk - 1)->_set().at(stk->_int());  // *OVR
+            if ((stk - 1)->is(variant::INTSET))
+                *(stk - 1) = (stk - 1)->_intset().at(stk->_int());  // *OVR
+            else
+                *(stk - 1) = (stk - 1)->_set().at(stk->_int());  // *OVR
             POPPOD();
             break;
 
@@ -718,7 +751,11 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
             POPPOD();
             break;
         case opFifoEnqVar:
-            INITPOP((stk - 1)->_fifo()->enq_var());
+            {
+                fifo* f = (stk - 1)->_fifo();
+                INITPOP(f->enq_var());
+                f->commit_var();
+            }
             break;
         case opFifoEnqChars:
             (stk - 1)->_fifo()->enq(stk->_str());
@@ -804,6 +841,30 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
         // Loop helpers
         case opStkVarGt:    *stk = int((basep + ADV(uchar))->_int() > stk->_int()); break;
         case opStkVarGe:    *stk = int((basep + ADV(uchar))->_int() >= stk->_int()); break;
+        case opStkVarNextBit:
+            {
+                integer& i = (basep + ADV(uchar))->_int();
+                int n = stk->_ordset().get_charset().next(int(imin<integer>(i, charset::BITS)));
+                if (n >= 0)
+                    i = n;
+                *stk = int(n < 0);
+            }
+            break;
+        case opStkVarNextKey:
+            {
+                integer& i = (basep + ADV(uchar))->_int();
+                const varvec& v = stk->_vec();
+                while (i < v.size() && v[i].is_null())
+                    i++;
+                *stk = int(i >= v.size());
+            }
+            break;
+        case opStkVarNextLine:
+            *stk = int(!stk->_fifo()->next_line((basep + ADV(uchar))->_str()));
+            break;
+        case opStkVarNextInt:
+            *stk = int(!stk->_intset().next((basep + ADV(uchar))->_int()));
+            break;
 
 
         // --- 12. JUMPS, CALLS ----------------------------------------------
@@ -907,7 +968,11 @@ farMethodCall:
 
         // --- 13. DEBUGGING, DIAGNOSTICS ------------------------------------
         case opLineNum:
+#ifdef SHN_PROFILE
+            allocprof::curLine = ADV(integer);
+#else
             ADV(integer);
+#endif
             break;
         case opAssert:
             {
@@ -921,7 +986,8 @@ farMethodCall:
         case opDump:
             {
                 str& expr = ADV(str);
-                dumpVar(expr, *stk, ADV(Type*));
+                dumpVar(*stk->_fifo(), expr, *(stk - 1), ADV(Type*));
+                POP();
                 POP();
             }
             break;
@@ -975,26 +1041,108 @@ Type* CodeGen::runConstExpr(rtstack& constStack, variant& result)
 }
 
 
+// --- Module Cache -------------------------------------------------------- //
+
+
+ModuleCache moduleCache;
+
+
+CachedModule::CachedModule(const str& path, int f) throw()
+    : symbol(path), module(), codeFlags(f), mtime(-1), size(-1), uses()
+        { str p = path; getFileStamp(p.c_str(), &mtime, &size); }
+
+
+CachedModule::~CachedModule() throw()
+    { uses.release_all(); }
+
+
+bool CachedModule::matches(CachedModule* e) const
+{
+    if (e->codeFlags != codeFlags || e->mtime != mtime || e->size != size
+            || e->uses.size() != uses.size())
+        return false;
+    for (memint i = 0; i < uses.size(); i++)
+        if (e->uses[i] != uses[i])
+            return false;
+    return true;
+}
+
+
+ModuleCache::ModuleCache() throw()
+    : entries()  { }
+
+
+// Runs at exit, possibly after strPool (a static in another file) has been
+// destroyed, so the entries are only released here; doneVm() purges the pool
+ModuleCache::~ModuleCache() throw()
+    { entries.release_all(); }
+
+
+objptr<Module> ModuleCache::find(CachedModule* probe)
+{
+#ifdef SHN_THR
+    scopelock l(lock);
+#endif
+    CachedModule* e = entries.find(probe->name);
+    if (e != NULL && e->matches(probe))
+        return e->module;
+    return NULL;
+}
+
+
+void ModuleCache::add(CachedModule* e)
+{
+    assert(e->module->isComplete());
+#ifdef SHN_THR
+    scopelock l(lock);
+#endif
+    CachedModule* old = entries.find(e->name);
+    if (old == e)
+        return;
+    if (old == NULL)
+        entries.add(e->grab<CachedModule>());
+    else
+    {
+        // The source or one of the used modules has changed
+        entries.replace(e->grab<CachedModule>());
+        old->release();
+    }
+}
+
+
+void ModuleCache::clear()
+{
+#ifdef SHN_THR
+    scopelock l(lock);
+#endif
+    entries.release_all();
+    entries.clear();
+}
+
+
 // --- Execution Context --------------------------------------------------- //
 
 
 ModuleInstance::ModuleInstance(Module* m) throw()
-    : symbol(m->getName()), module(m), obj()  { }
+    : symbol(m->getName()), module(m), obj(), uses(), cached(), snapshot()  { }
 
 ModuleInstance::~ModuleInstance() throw()
     { }
 
-void ModuleInstance::run(Context* context, rtstack& stack)
+void ModuleInstance::run(rtstack& stack)
 {
     assert(module->isComplete());
 
     // Assign module vars. This allows to generate code that accesses module
-    // static data by variable id, so that code is context-independent
-    for (memint i = 0; i < module->usedModuleVars.size(); i++)
+    // static data by variable id, so that code is context-independent. The
+    // used instances are in the same order as the module vars.
+    if (uses.size() != module->usedModuleVars.size())
+        fatal(0x5003, "Module not found");
+    for (memint i = 0; i < uses.size(); i++)
     {
         InnerVar* v = module->usedModuleVars[i];
-        stateobj* o = context->getModuleObject(v->getModuleType());
-        *obj->member(v->id) = o;
+        assert(uses[i]->module == v->getModuleType());
+        *obj->member(v->id) = uses[i]->obj.get();
     }
 
     // Run module initialization or main code
@@ -1003,8 +1151,224 @@ void ModuleInstance::run(Context* context, rtstack& stack)
 }
 
 
+// Copies module data for snapshots, see Context::run(). Containers are
+// copy-on-write and are shared unless they hold objects; objects reachable
+// from module variables are duplicated, preserving shared and circular
+// references. Module instances and fifos are never copied.
+
+class StateCopier
+{
+protected:
+    vardict copies;     // original object -> its copy
+    static bool same(const variant& a, const variant& b)
+        { return !a.is_anyobj() || a._anyobj() == b._anyobj(); }
+public:
+    StateCopier(const objvec<ModuleInstance>&);
+    bool hasObjects(const variant&);    // i.e. copy() would change something
+    variant copy(const variant&);
+};
+
+
+StateCopier::StateCopier(const objvec<ModuleInstance>& instances)
+{
+    for (memint i = 0; i < instances.size(); i++)
+    {
+        variant o = instances[i]->obj.get();
+        copies.find_replace(o, o);
+    }
+}
+
+
+bool StateCopier::hasObjects(const variant& v)
+{
+    switch (v.getType())
+    {
+    case variant::VEC:
+        {
+            const varvec& s = v._vec();
+            for (memint i = 0; i < s.size(); i++)
+                if (hasObjects(s[i]))
+                    return true;
+            return false;
+        }
+    case variant::SET:
+        {
+            const varset& s = v._set();
+            for (memint i = 0; i < s.size(); i++)
+                if (hasObjects(s[i]))
+                    return true;
+            return false;
+        }
+    case variant::DICT:
+        {
+            const vardict& s = v._dict();
+            for (memint i = 0; i < s.size(); i++)
+                if (hasObjects(s.key(i)) || hasObjects(s.value(i)))
+                    return true;
+            return false;
+        }
+    case variant::REF:
+        return true;
+    case variant::RTOBJ:
+        {
+            rtobject* o = v._rtobj();
+            if (o == NULL)
+                return false;
+            // Module instances are mapped onto themselves
+            const variant* c = copies.find(v);
+            if (c != NULL)
+                return !same(*c, v);
+            return o->getType()->isState() || o->getType()->isFuncPtr();
+        }
+    default:
+        return false;
+    }
+}
+
+
+variant StateCopier::copy(const variant& v)
+{
+    switch (v.getType())
+    {
+    case variant::VEC:
+        {
+            const varvec& s = v._vec();
+            varvec d = s;
+            for (memint i = 0; i < s.size(); i++)
+            {
+                variant e = copy(s[i]);
+                if (!same(e, s[i]))
+                    d.replace(i, e);
+            }
+            return d;
+        }
+    case variant::SET:
+        {
+            // Copied objects may sort differently, hence the new set; it is
+            // started with the elements seen so far once the first copy is met
+            const varset& s = v._set();
+            varset d;
+            bool changed = false;
+            for (memint i = 0; i < s.size(); i++)
+            {
+                variant e = copy(s[i]);
+                if (!changed && !same(e, s[i]))
+                {
+                    changed = true;
+                    for (memint j = 0; j < i; j++)
+                        d.find_insert(s[j]);
+                }
+                if (changed)
+                    d.find_insert(e);
+            }
+            return changed ? variant(d) : v;
+        }
+    case variant::DICT:
+        {
+            const vardict& s = v._dict();
+            vardict d;
+            bool changed = false;
+            for (memint i = 0; i < s.size(); i++)
+            {
+                variant k = copy(s.key(i));
+                variant e = copy(s.value(i));
+                if (!changed && (!same(k, s.key(i)) || !same(e, s.value(i))))
+                {
+                    changed = true;
+                    for (memint j = 0; j < i; j++)
+                        d.find_replace(s.key(j), s.value(j));
+                }
+                if (changed)
+                    d.find_replace(k, e);
+            }
+            return changed ? variant(d) : v;
+        }
+    case variant::REF:
+        {
+            const variant* c = copies.find(v);
+            if (c != NULL)
+                return *c;
+            reference* r = new reference();
+            variant t = r;
+            copies.find_replace(v, t);
+            r->var = copy(v._ref()->var);
+            return t;
+        }
+    case variant::RTOBJ:
+        {
+            rtobject* o = v._rtobj();
+            if (o == NULL)
+                return v;
+            const variant* c = copies.find(v);
+            if (c != NULL)
+                return *c;
+            Type* type = o->getType();
+            if (type->isState())
+            {
+                State* state = cast<State*>(type);
+                stateobj* so = cast<stateobj*>(o);
+                stateobj* d = state->newInstance();
+                variant t = d;
+                copies.find_replace(v, t);
+                for (memint i = 0; i < state->varCount; i++)
+                    *d->member(i) = copy(*so->member(i));
+                return t;
+            }
+            if (type->isFuncPtr())
+            {
+                funcptr* f = cast<funcptr*>(o);
+                variant outer = copy(variant(f->outer.get()));
+                variant t = new funcptr(f->dataseg, outer._stateobj(), f->state);
+                copies.find_replace(v, t);
+                return t;
+            }
+            return v;
+        }
+    default:
+        return v;
+    }
+}
+
+
+void ModuleInstance::saveState(StateCopier& copier)
+{
+    // The snapshot is a copy, so that the objects it holds are not affected
+    // by subsequent runs; only the slots that reach objects are copied, the
+    // rest are shared
+    snapshot.clear();
+    objSlots.clear();
+    for (memint i = 0; i < module->varCount; i++)
+    {
+        const variant& v = *obj->member(i);
+        if (copier.hasObjects(v))
+        {
+            objSlots.push_back(i);
+            snapshot.push_back(copier.copy(v));
+        }
+        else
+            snapshot.push_back(v);
+    }
+}
+
+
+void ModuleInstance::restoreState(StateCopier& copier)
+{
+    memint k = 0;
+    for (memint i = 0; i < snapshot.size(); i++)
+        if (k < objSlots.size() && objSlots[k] == i)
+        {
+            *obj->member(i) = copier.copy(snapshot[i]);
+            k++;
+        }
+        else
+            *obj->member(i) = snapshot[i];
+}
+
+
 void ModuleInstance::finalize()
 {
+    snapshot.clear();
+    objSlots.clear();
     if (!obj.empty())
     {
         try
@@ -1022,7 +1386,8 @@ void ModuleInstance::finalize()
 
 CompilerOptions::CompilerOptions() throw()
   : enableDump(true), enableAssert(true), lineNumbers(true),
-    vmListing(true), compileOnly(false), stackSize(8192)
+    vmListing(true), compileOnly(false), lazyBodies(true), compileThreads(4),
+    moduleCache(false), stackSize(8192)
         { modulePath.push_back("./"); }
 
 
@@ -1035,16 +1400,24 @@ void CompilerOptions::setDebugOpts(bool flag)
 }
 
 
+int CompilerOptions::codeFlags() const
+    { return int(enableDump) | (int(enableAssert) << 1) | (int(lineNumbers) << 2); }
+
+
 static str moduleNameFromFileName(const str& n)
     { return remove_filename_path(remove_filename_ext(n)); }
 
 
 Context::Context()
-    : queenBeeInst(addModule(queenBee))  { }
+    : queenBeeInst(addModule(queenBee)), stack(0), initialized(false)  { }
 
 
 Context::~Context()
-    { instances.release_all(); }
+{
+    // Strings interned by the modules are purged once all of them are gone
+    instances.release_all();
+    strPool.purge();
+}
 
 
 ModuleInstance* Context::addModule(Module* m)
@@ -1059,17 +1432,243 @@ ModuleInstance* Context::addModule(Module* m)
 }
 
 
-Module* Context::loadModule(const str& filePath)
+static void scanUses(const str& filePath, strvec& modNames)
 {
-    // TODO: store the current file name in a named const, say __FILE__
+    Parser parser(new intext(NULL, filePath));
+    try
+    {
+        parser.next();
+        parser.skipWsSeps();
+        parser.usesClauses(modNames);
+    }
+    catch (exception& e)
+    {
+        throw emessage(filePath + '(' + to_string(parser.getLineNum()) + "): " + e.what());
+    }
+}
+
+
+ModuleInstance* Context::addModuleTree(const str& filePath, strvec& chain)
+{
+    // Registers the module after the modules it uses, recursively; chain
+    // holds the names of the modules being discovered
     str modName = moduleNameFromFileName(filePath);
-    objptr<Module> m = new Module(modName, filePath);
-    addModule(m);
-    Compiler compiler(*this, m, new intext(NULL, filePath));
+    for (memint i = 0; i < chain.size(); i++)
+        if (chain[i] == modName)
+            throw emessage("Circular module reference: " + modName);
+    // The file stamp is taken before the source is read
+    objptr<CachedModule> cached;
+    if (options.moduleCache)
+        cached = new CachedModule(canonicalPath(filePath), options.codeFlags());
+    strvec usedNames;
+    scanUses(filePath, usedNames);
+    // The system module is used implicitly, see Compiler::compileModule()
+    podvec<ModuleInstance*> uses;
+    uses.push_back(queenBeeInst);
+    chain.push_back(modName);
+    for (memint i = 0; i < usedNames.size(); i++)
+    {
+        ModuleInstance* used = instTable.find(usedNames[i]);
+        if (used == NULL)
+            used = addModuleTree(lookupSource(usedNames[i]), chain);
+        uses.push_back(used);
+    }
+    chain.pop_back();
+    objptr<Module> m;
+    if (!cached.empty())
+    {
+        for (memint i = 0; i < uses.size(); i++)
+            cached->uses.push_back(uses[i]->module->grab<Module>());
+        m = moduleCache.find(cached);
+    }
+    if (m.empty())
+        m = new Module(modName, filePath);
+    ModuleInstance* inst = addModule(m);
+    inst->uses = uses;
+    if (!m->isComplete())
+        inst->cached = cached;
+    return inst;
+}
+
+
+static void compileModule(Context& context, ModuleInstance* inst)
+{
+    Compiler compiler(context, inst->module, new intext(NULL, inst->module->filePath));
     compiler.compileModule();
+}
+
+
+#ifdef SHN_THR
+
+// Modules are picked by the worker threads as soon as all the modules they
+// use are compiled
+struct CompileQueue: noncopyable
+{
+    Context& context;
+    mutex lock;
+    condvar cond;
+    podvec<ModuleInstance*> modules;    // not picked yet
+    podvec<memint> waiting;             // number of used modules not compiled yet
+    memint remaining;                   // not compiled yet
+    bool failed;
+    str error;
+
+    CompileQueue(Context& c) throw()
+        : context(c), remaining(0), failed(false)  { }
+    void add(ModuleInstance*);
+    ModuleInstance* get();  // NULL if nothing's left to compile
+    void done(ModuleInstance*);
+    void fail(exception&);
+};
+
+
+void CompileQueue::add(ModuleInstance* inst)
+{
+    if (inst->module->isComplete())
+        return;
+    memint count = 0;
+    for (memint i = 0; i < inst->uses.size(); i++)
+        if (!inst->uses[i]->module->isComplete())
+            count++;
+    modules.push_back(inst);
+    waiting.push_back(count);
+    remaining++;
+}
+
+
+ModuleInstance* CompileQueue::get()
+{
+    scopelock l(lock);
+    while (!failed && remaining > 0)
+    {
+        for (memint i = 0; i < modules.size(); i++)
+            if (waiting[i] == 0)
+            {
+                ModuleInstance* inst = modules[i];
+                modules.erase(i);
+                waiting.erase(i);
+                return inst;
+            }
+        cond.wait(lock);
+    }
+    return NULL;
+}
+
+
+void CompileQueue::done(ModuleInstance* inst)
+{
+    scopelock l(lock);
+    remaining--;
+    for (memint i = 0; i < modules.size(); i++)
+    {
+        const podvec<ModuleInstance*>& uses = modules[i]->uses;
+        for (memint j = 0; j < uses.size(); j++)
+            if (uses[j] == inst)
+                waiting.atw(i)--;
+    }
+    cond.broadcast();
+}
+
+
+void CompileQueue::fail(exception& e)
+{
+    scopelock l(lock);
+    if (!failed)
+    {
+        failed = true;
+        error = e.what();
+    }
+    cond.broadcast();
+}
+
+
+class CompileWorker: public object, protected thread
+{
+protected:
+    CompileQueue& queue;
+    void execute();
+public:
+    CompileWorker(CompileQueue& q) throw()
+        : queue(q)  { start(); }
+    ~CompileWorker() throw()
+        { join(); }
+};
+
+
+void CompileWorker::execute()
+{
+    while (ModuleInstance* inst = queue.get())
+    {
+        try
+        {
+            compileModule(queue.context, inst);
+        }
+        catch (exception& e)
+        {
+            queue.fail(e);
+            return;
+        }
+        queue.done(inst);
+    }
+}
+
+#endif // SHN_THR
+
+
+void Context::compileModules(memint first)
+{
+    // Modules from `first' on are registered in dependency order, so they
+    // can be compiled either one by one or concurrently as soon as their
+    // used modules are ready. The instance tables are not modified during
+    // compilation, which makes getModule() thread-safe. Modules found in the
+    // module cache are complete already.
+#ifdef SHN_THR
+    CompileQueue queue(*this);
+    for (memint i = first; i < instances.size(); i++)
+        queue.add(instances[i]);
+    memint count = queue.remaining;
+    if (options.compileThreads > 1 && count > 1)
+    {
+        objvec<CompileWorker> workers;
+        for (memint i = imin(options.compileThreads, count); i--; )
+            workers.push_back((new CompileWorker(queue))->grab<CompileWorker>());
+        workers.release_all();  // waits for the threads to finish
+        if (queue.failed)
+            throw emessage(queue.error);
+    }
+    else
+#endif
+    for (memint i = first; i < instances.size(); i++)
+        if (!instances[i]->module->isComplete())
+            compileModule(*this, instances[i]);
+    // Make the new modules available to other contexts
+    for (memint i = first; i < instances.size(); i++)
+    {
+        ModuleInstance* inst = instances[i];
+        if (!inst->cached.empty())
+        {
+            inst->cached->module = inst->module;
+            moduleCache.add(inst->cached);
+            inst->cached.clear();
+        }
+    }
+}
+
+
+Module* Context::loadModule(const str& filePath)
+{
+    // TODO: store the current file name in a named const, say __FILE__
+    // Discover the modules used by this one first; the new modules are then
+    // registered after the ones they use, this one being the last. The
+    // modules loaded before are initialized again on the next run().
+    clear();
+    memint first = instances.size();
+    strvec chain;
+    ModuleInstance* inst = addModuleTree(filePath, chain);
+    compileModules(first);
     if (options.enableDump || options.vmListing)
         dump(remove_filename_ext(filePath) + ".lst");
-    return m;
+    return inst->module;
 }
 
 
@@ -1088,23 +1687,11 @@ str Context::lookupSource(const str& modName)
 Module* Context::getModule(const str& modName)
 {
     // TODO: find a moudle by full path, not just name (hash by path/name?)
-    // TODO: to have a global cache of compiled modules, not just within the context
+    // Used modules are discovered and compiled beforehand, see loadModule()
     ModuleInstance* inst = instTable.find(modName);
-    if (inst != NULL)
-        return inst->module;
-    else
-        return loadModule(lookupSource(modName));
-}
-
-
-stateobj* Context::getModuleObject(Module* m)
-{
-    // TODO: Linear search, can be improved later
-    for (memint i = 0; i < instances.size(); i++)
-        if (instances[i]->module == m)
-            return instances[i]->obj;
-    fatal(0x5003, "Module not found");
-    return NULL;
+    if (inst == NULL || !inst->module->isComplete())
+        throw emessage("Module not compiled: " + modName);
+    return inst->module;
 }
 
 
@@ -1117,6 +1704,48 @@ void Context::instantiateModules()
             fatal(0x5004, "Module not compiled");
         inst->obj = inst->module->newInstance();
     }
+    if (!stdOut.empty())
+        *queenBeeInst->obj->member(queenBee->sioVar->id) = stdOut.get();
+    if (!stdErr.empty())
+        *queenBeeInst->obj->member(queenBee->serrVar->id) = stdErr.get();
+}
+
+
+void Context::setStdStreams(fifo* out, fifo* err)
+{
+    if (!out->is_char_fifo() || !err->is_char_fifo())
+        throw emessage("Standard streams should be character fifos");
+    if (out->getType() == NULL)
+        out->setType(queenBee->defCharFifo);
+    if (err->getType() == NULL)
+        err->setType(queenBee->defCharFifo);
+    stdOut = out;
+    stdErr = err;
+}
+
+
+void Context::initialize()
+{
+    // Instantiate all modules and run the initialization code of all but the
+    // main one, which is the last
+    if (instances.size() < 2)
+        throw emessage("No program loaded");
+    instantiateModules();
+    stack = rtstack(options.stackSize);
+    try
+    {
+        for (memint i = 0; i < instances.size() - 1; i++)
+            instances[i]->run(stack);
+        StateCopier copier(instances);
+        for (memint i = 0; i < instances.size() - 1; i++)
+            instances[i]->saveState(copier);
+    }
+    catch (exception&)
+    {
+        clear();
+        throw;
+    }
+    initialized = true;
 }
 
 
@@ -1124,6 +1753,7 @@ void Context::clear()
 {
     for (memint i = instances.size(); i--; )
         instances[i]->finalize();
+    initialized = false;
 }
 
 
@@ -1151,7 +1781,7 @@ variant Context::execute()
     try
     {
         for (memint i = 0; i < instances.size(); i++)
-            instances[i]->run(this, stack);
+            instances[i]->run(stack);
     }
     catch (eexit& e)
     {
@@ -1170,6 +1800,316 @@ variant Context::execute()
 }
 
 
-void initVm()  { if (opMaxCode > 255) fatal(0x5001, "Opcodes > 255"); }
-void doneVm()  { }
+// --- Heap Images --------------------------------------------------------- //
+
+
+// The image starts with a header that identifies the program (see
+// imageHeader()) and a checksum of the rest, which is the data segments of
+// all modules except the system and the main ones. An object is written on its first occurrence as
+// the qualified name of its state followed by its members, and afterwards
+// as its index; module objects are referred to by their position in the
+// context.
+
+class HeapImageCodec: public bincodec
+{
+protected:
+    varvec objects;
+    vardict objIndex;   // object -> index in objects
+    podvec<State*> states;
+    vardict stateIndex; // qualified name -> index in states, -1 if ambiguous
+    static str stateName(State*);
+    static void invalid();
+public:
+    HeapImageCodec(const objvec<ModuleInstance>&);
+    void enq_obj(fifo&, const variant&);
+    void deq_obj(fifo&, variant&);
+};
+
+
+str HeapImageCodec::stateName(State* s)
+{
+    strfifo f(NULL);
+    s->fqName(f);
+    return f.all();
+}
+
+
+void HeapImageCodec::invalid()
+    { throw emessage("Invalid heap image"); }
+
+
+HeapImageCodec::HeapImageCodec(const objvec<ModuleInstance>& instances)
+{
+    for (memint i = 0; i < instances.size(); i++)
+    {
+        variant o = instances[i]->obj.get();
+        objIndex.find_replace(o, integer(objects.size()));
+        objects.push_back(o);
+        instances[i]->module->listStates(states);
+    }
+    for (memint i = 0; i < states.size(); i++)
+    {
+        str name = stateName(states[i]);
+        stateIndex.find_replace(name, stateIndex.find_key(name) ? integer(-1) : integer(i));
+    }
+}
+
+
+void HeapImageCodec::enq_obj(fifo& f, const variant& v)
+{
+    const variant* index = objIndex.find(v);
+    if (index != NULL)
+    {
+        f.bin_write(*index, NULL);
+        return;
+    }
+    rtobject* o = v._rtobj();
+    if (o == NULL)
+    {
+        f.bin_write(variant(), NULL);
+        return;
+    }
+    if (!o->getType()->isAnyState() || o->getType()->isModule())
+        throw emessage("Object can't be saved in a heap image");
+    State* state = cast<State*>(o->getType());
+    str name = stateName(state);
+    const variant* si = stateIndex.find(name);
+    if (si == NULL || si->_int() < 0)
+        throw emessage("Ambiguous state name in heap image: " + name);
+    objIndex.find_replace(v, integer(objects.size()));
+    objects.push_back(v);
+    f.bin_write(name, NULL);
+    f.bin_write(integer(state->varCount), NULL);
+    stateobj* so = cast<stateobj*>(o);
+    for (memint i = 0; i < state->varCount; i++)
+        f.bin_write(*so->member(i), this);
+}
+
+
+void HeapImageCodec::deq_obj(fifo& f, variant& v)
+{
+    variant t;
+    f.bin_read(t, NULL);
+    if (t.is_null())
+        v = (stateobj*)NULL;
+    else if (t.is(variant::ORD))
+    {
+        if (t._int() < 0 || t._int() >= objects.size())
+            invalid();
+        v = objects[memint(t._int())];
+    }
+    else if (t.is(variant::STR))
+    {
+        const variant* si = stateIndex.find(t);
+        if (si == NULL || si->_int() < 0)
+            invalid();
+        State* state = states[memint(si->_int())];
+        variant count;
+        f.bin_read(count, NULL);
+        if (count != integer(state->varCount))
+            invalid();
+        stateobj* so = state->newInstance();
+        v = so;
+        objects.push_back(v);
+        for (memint i = 0; i < state->varCount; i++)
+            f.bin_read(*so->member(i), this);
+    }
+    else
+        invalid();
+}
+
+
+variant Context::imageHeader()
+{
+    varvec h;
+    h.push_back(str("#SHNIMG"));
+    h.push_back(integer(2));    // format version
+    h.push_back(integer(sizeof(integer)));
+    h.push_back(integer(options.codeFlags()));
+    for (memint i = 1; i < instances.size(); i++)
+    {
+        Module* m = instances[i]->module;
+        intext source(NULL, m->filePath);
+        h.push_back(m->getName());
+        h.push_back(integer(source.deq(fifo::CHAR_ALL).hash()));
+        h.push_back(integer(m->varCount));
+    }
+    return h;
+}
+
+
+static atomicint imageTmpCount = 0;
+
+
+void Context::saveImage(const str& filePath)
+{
+    // The image is written to a temporary file that is then renamed, so that
+    // an interrupted save never leaves a partial image behind; the name is
+    // unique across processes and threads
+    if (!initialized)
+        initialize();
+    str path = filePath;
+    str tmpPath = filePath + '.' + to_string(integer(getpid())) + '-'
+        + to_string(integer(pincrement(&imageTmpCount))) + ".tmp";
+    try
+    {
+        HeapImageCodec codec(instances);
+        strfifo data(NULL);
+        for (memint i = 1; i < instances.size() - 1; i++)
+        {
+            const varvec& snapshot = instances[i]->snapshot;
+            for (memint j = 0; j < snapshot.size(); j++)
+                data.bin_write(snapshot[j], &codec);
+        }
+        str payload = data.all();
+        outtext f(NULL, tmpPath);
+        f.bin_write(imageHeader(), NULL);
+        f.bin_write(integer(payload.hash()), NULL);
+        f << payload;
+        f.sync();
+    }
+    catch (exception&)
+    {
+        ::remove(tmpPath.c_str());
+        throw;
+    }
+    if (::rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        int code = errno;
+        ::remove(tmpPath.c_str());
+        throw esyserr(code, filePath);
+    }
+}
+
+
+bool Context::loadImage(const str& filePath)
+{
+    // The header identifies the program and is followed by a checksum of
+    // the data; a damaged image, even if it can still be decoded, is treated
+    // the same as a mismatching header, as are decoding errors
+    if (instances.size() < 2)
+        throw emessage("No program loaded");
+    clear();
+    str path = filePath;
+    if (!isFile(path.c_str()))
+        return false;
+    variant expected = imageHeader();
+    str payload;
+    try
+    {
+        intext f(NULL, filePath);
+        variant header, checksum;
+        f.bin_read(header, NULL);
+        if (header != expected)
+            return false;
+        f.bin_read(checksum, NULL);
+        payload = f.deq(fifo::CHAR_ALL);
+        if (checksum != integer(payload.hash()))
+            return false;
+    }
+    catch (emessage&)
+    {
+        return false;
+    }
+
+    // The system module is initialized as usual, the rest is read from the
+    // image; the main module's code is left for run()
+    instantiateModules();
+    stack = rtstack(options.stackSize);
+    try
+    {
+        queenBeeInst->run(stack);
+        HeapImageCodec codec(instances);
+        strfifo data(NULL, payload);
+        bool valid = true;
+        try
+        {
+            for (memint i = 1; i < instances.size() - 1; i++)
+            {
+                ModuleInstance* inst = instances[i];
+                for (memint j = 0; j < inst->module->varCount; j++)
+                    data.bin_read(*inst->obj->member(j), &codec);
+            }
+            valid = data.empty();
+        }
+        catch (emessage&)
+        {
+            valid = false;
+        }
+        if (!valid)
+        {
+            clear();
+            return false;
+        }
+        StateCopier copier(instances);
+        for (memint i = 0; i < instances.size() - 1; i++)
+            instances[i]->saveState(copier);
+    }
+    catch (exception&)
+    {
+        clear();
+        throw;
+    }
+    initialized = true;
+    return true;
+}
+
+
+variant Context::run(const variant& args)
+{
+    if (options.compileOnly)
+        return variant();
+
+    if (!initialized)
+        initialize();
+    else
+    {
+        StateCopier copier(instances);
+        for (memint i = 0; i < instances.size() - 1; i++)
+            instances[i]->restoreState(copier);
+    }
+
+    // The main module gets a fresh instance on each run
+    ModuleInstance* main = instances.back();
+    main->obj = main->module->newInstance();
+    *queenBeeInst->obj->member(queenBee->argsVar->id) = args;
+    variant result;
+    try
+    {
+        main->run(stack);
+        result = *queenBeeInst->obj->member(queenBee->resultVar->id);
+    }
+    catch (eexit& e)
+    {
+        result = e.result;
+    }
+    catch (exception&)
+    {
+        clear();
+        throw;
+    }
+    main->finalize();
+    return result;
+}
+
+
+static initcount vmInit;
+
+
+void initVm()
+{
+    initscope init(vmInit, true);
+    if (init.needed() && opMaxCode > 255)
+        fatal(0x5001, "Opcodes > 255");
+}
+
+
+void doneVm()
+{
+    initscope done(vmInit, false);
+    if (!done.needed())
+        return;
+    moduleCache.clear();
+    strPool.purge();
+}
 
@@ -129,6 +129,9 @@ enum OpCode
     opRngToByteSet,     // -int -int +set
     opByteSetAddElem,   // -int -set +set
     opByteSetAddRng,    // -int -int -set +set
+    opElemToIntSet,     // -int +set
+    opRngToIntSet,      // -int -int +set
+    opIntSetAddRng,     // -int -int -set +set
     opInSet,            // -set -var +bool
     opInByteSet,        // -set -int +bool
     opInBounds,         // [Ordinal*] -int +bool
@@ -212,6 +215,10 @@ enum OpCode
     // for loop helpers
     opStkVarGt,         // [stk.idx:u8] -int +bool
     opStkVarGe,         // [stk.idx:u8] -int +bool
+    opStkVarNextBit,    // [stk.idx:u8] -ordset +bool -- advance to next member; true at end
+    opStkVarNextKey,    // [stk.idx:u8] -vec +bool -- next non-null byte dict slot; true at end
+    opStkVarNextLine,   // [stk.idx:u8] -fifo +bool -- read next line into the var; true at end
+    opStkVarNextInt,    // [stk.idx:u8] -intset +bool -- advance to next member; true at end
 
     // --- 12. JUMPS, CALLS
     // Jumps; [dst] is a relative 16-bit offset
@@ -233,7 +240,7 @@ enum OpCode
     // --- 13. DEBUGGING, DIAGNOSTICS
     opLineNum,          // [linenum:int]
     opAssert,           // [linenum:int, cond:str] -bool
-    opDump,             // [expr:str, type:Type*] -var
+    opDump,             // [expr:str, type:Type*] -fifo -var
 
     opInv,
     opMaxCode = opInv,
@@ -513,6 +520,7 @@ public:
 
     void stkVarCmp(StkVar*, OpCode);
     void stkVarCmpLength(StkVar* var, StkVar* vec);
+    void stkVarNextElem(StkVar* var);
 
     void boolJump(memint target, OpCode op);
     memint boolJumpForward(OpCode op);
@@ -566,24 +574,74 @@ struct CompilerOptions
     bool lineNumbers;
     bool vmListing;
     bool compileOnly;
+    bool lazyBodies;    // compile function bodies on first reference
+    memint compileThreads; // max. modules compiled concurrently (SHN_THR only)
+    bool moduleCache;   // share compiled modules with other contexts, see ModuleCache
     memint stackSize;
     strvec modulePath;
 
     CompilerOptions() throw();
     void setDebugOpts(bool);
+    int codeFlags() const;  // options that affect the generated code
 };
 
 
+// Process-wide cache of compiled modules keyed by the canonical path of the
+// source file. An entry is reused by another context as long as the file's
+// modification time and size, the code generation options and the used
+// modules are the same. Cached modules are compiled eagerly so that they
+// never change once compiled and can be shared by concurrent contexts.
+
+class CachedModule: public symbol
+{
+public:
+    objptr<Module> module;
+    int codeFlags;
+    large mtime;
+    large size;
+    objvec<Module> uses;    // owned
+    CachedModule(const str& path, int codeFlags) throw();
+    ~CachedModule() throw();
+    bool matches(CachedModule*) const;
+};
+
+
+class ModuleCache: noncopyable
+{
+protected:
+    symtbl<CachedModule> entries;   // owned
+#ifdef SHN_THR
+    mutex lock;
+#endif
+public:
+    ModuleCache() throw();
+    ~ModuleCache() throw();
+    objptr<Module> find(CachedModule* probe);  // NULL if not cached or outdated
+    void add(CachedModule*);
+    void clear();
+};
+
+
+extern ModuleCache moduleCache;
+
+
 class Context;
+class StateCopier;
 
 class ModuleInstance: public symbol
 {
 public:
     objptr<Module> module;
     objptr<stateobj> obj;
+    podvec<ModuleInstance*> uses;   // same order as module->usedModuleVars, system module first
+    objptr<CachedModule> cached;    // to be added to the module cache once compiled
+    varvec snapshot;                // module state after initialization, see Context::run()
+    podvec<memint> objSlots;        // snapshot slots that reach objects, copied on each run
     ModuleInstance(Module* m) throw();
     ~ModuleInstance() throw();
-    void run(Context*, rtstack&);
+    void run(rtstack&);
+    void saveState(StateCopier&);
+    void restoreState(StateCopier&);
     void finalize();
 };
 
@@ -594,10 +652,18 @@ protected:
     symtbl<ModuleInstance> instTable;
     objvec<ModuleInstance> instances;
     ModuleInstance* queenBeeInst;
+    rtstack stack;          // kept between calls to run()
+    bool initialized;       // used modules are initialized, see run()
+    objptr<fifo> stdOut;    // replace the global sio and serr if set
+    objptr<fifo> stdErr;
 
     ModuleInstance* addModule(Module*);
+    ModuleInstance* addModuleTree(const str& filePath, strvec& chain);
     str lookupSource(const str& modName);
+    void compileModules(memint first);
     void instantiateModules();
+    void initialize();
+    variant imageHeader();
     void clear();
     void dump(const str& listingPath);
 
@@ -607,10 +673,34 @@ public:
     Context();
     ~Context();
 
-    Module* getModule(const str& name);     // for use by the compiler, "uses" clause
-    stateobj* getModuleObject(Module*);     // for initializing module vars in ModuleInstance::run()
+    // Contexts can be run concurrently, each in its own thread, as long as
+    // they don't share runtime objects: compiled modules are shared through
+    // the module cache (see CompilerOptions::moduleCache) and are not
+    // modified at run time, and each context should have its own standard
+    // fifos and no VM listings. The allocation profiler (SHN_PROFILE) is not
+    // available in threaded builds.
+    void setStdStreams(fifo* out, fifo* err);   // before run() or execute()
+
+    Module* getModule(const str& name);     // for use by the compiler, "uses" clause; thread-safe
     Module* loadModule(const str& filePath);
     variant execute();                      // after compilation only (loadModule())
+
+    // Embedding: the program is compiled once with loadModule() and can then
+    // be executed any number of times with run(). The modules used by the
+    // main one are initialized on the first call only; subsequent calls bring
+    // their state back to what it was after initialization and re-run the
+    // main module. The arguments are available to the program as
+    // system.__program_args, and __program_result is returned.
+    variant run(const variant& args = variant());
+    void reset()                            { clear(); }    // re-initialize on next run()
+
+    // Heap images: the state of the used modules after initialization can be
+    // saved and then restored by another process that runs the same program,
+    // instead of running the initialization code. An image is rejected if any
+    // of the sources or the code options differ. Images can hold anything
+    // except function pointers, fifos and references.
+    void saveImage(const str& filePath);    // initializes the modules if needed
+    bool loadImage(const str& filePath);    // before run(); false if missing, outdated or damaged
 };
 
 
@@ -392,6 +392,11 @@ void CodeGen::loadTypeRefConst(Type* type)
 void CodeGen::loadConst(Type* type, const variant& value)
 {
     // NOTE: compound consts should be held by a smart pointer somewhere else
+    // Code can be shared between threads (see CompilerOptions::moduleCache),
+    // so the hash caches of the constants are filled now rather than at run
+    // time (see container::hash())
+    if (value.is_anyobj())
+        value.hash();
     switch(value.getType())
     {
     case variant::VOID:
@@ -424,6 +429,7 @@ void CodeGen::loadConst(Type* type, const variant& value)
     case variant::VEC:
     case variant::SET:
     case variant::ORDSET:
+    case variant::INTSET:
     case variant::DICT:
         addOp<uchar>(type, opLoadConstObj, value.getType());
         add<object*>(value._anyobj());
@@ -449,6 +455,7 @@ void CodeGen::loadTypeRef(Type* type)
         // (3) member constant selection or scope override is requested: same 
         // as (2); or (4) otherwise the function pointer is left "as is".
         State* stateType = PState(type);
+        stateType->compileBody();  // in case it was deferred, see Compiler::deferBody()
         if (stateType->isStatic())
         {
             addOp<State*>(stateType->prototype, opLoadStaticFuncPtr, stateType);
@@ -500,7 +507,7 @@ static variant::Type typeToVarType(Type* t)
     //    NULLCONT, VEC, SET, DICT,
     //    FIFO, PROTOTYPE, SELFSTUB, STATE
     // VOID, ORD, REAL, VARPTR,
-    //      STR, VEC, SET, ORDSET, DICT, REF, RTOBJ
+    //      STR, VEC, SET, ORDSET, INTSET, DICT, REF, RTOBJ
     switch (t->typeId)
     {
     case Type::TYPEREF:
@@ -521,7 +528,7 @@ static variant::Type typeToVarType(Type* t)
     case Type::VEC:
         return t->isByteVec() ? variant::STR : variant::VEC;
     case Type::SET:
-        return t->isByteSet() ? variant::ORDSET : variant::SET;
+        return t->isByteSet() ? variant::ORDSET : t->isIntSet() ? variant::INTSET : variant::SET;
     case Type::DICT:
         return t->isByteDict() ? variant::VEC : variant::DICT;
     case Type::FUNCPTR:
@@ -653,6 +660,7 @@ void CodeGen::loadMember(State* hostStateType, State* stateType)
     assert(hostStateType == stkType());
     if (stateType->parent != hostStateType)  // shouldn't happen
         fatal(0x600d, "Invalid member state selection");
+    stateType->compileBody();
     if (stateType->isStatic())
     {
         undoSubexpr();
@@ -977,7 +985,8 @@ Container* CodeGen::elemToSet()
     Type* elemType = stkType();
     Container* setType = elemType->deriveSet(typeReg);
     stkPop();
-    addOp(setType, setType->isByteSet() ? opElemToByteSet : opElemToSet);
+    addOp(setType, setType->isByteSet() ? opElemToByteSet
+        : setType->isIntSet() ? opElemToIntSet : opElemToSet);
     return setType;
 }
 
@@ -990,11 +999,11 @@ Container* CodeGen::rangeToSet()
     if (!left->canAssignTo(stkType()))
         error("Incompatible range bounds");
     Container* setType = left->deriveSet(typeReg);
-    if (!setType->isByteSet())
+    if (!setType->isByteSet() && !setType->isIntSet())
         error("Invalid element type for ordinal set");
     stkPop();
     stkPop();
-    addOp(setType, opRngToByteSet);
+    addOp(setType, setType->isByteSet() ? opRngToByteSet : opRngToIntSet);
     return setType;
 }
 
@@ -1013,8 +1022,8 @@ void CodeGen::setAddElem()
 void CodeGen::checkRangeLeft()
 {
     Type* setType = stkType(2);
-    if (!setType->isByteSet())
-        error("Byte set type expected");
+    if (!setType->isByteSet() && !setType->isIntSet())
+        error("Ordinal set type expected");
     implicitCast(PContainer(setType)->index, "Set element type mismatch");
 }
 
@@ -1022,12 +1031,12 @@ void CodeGen::checkRangeLeft()
 void CodeGen::setAddRange()
 {
     Type* setType = stkType(3);
-    if (!setType->isByteSet())
-        error("Byte set type expected");
+    if (!setType->isByteSet() && !setType->isIntSet())
+        error("Ordinal set type expected");
     implicitCast(PContainer(setType)->index, "Set element type mismatch");
     stkPop();
     stkPop();
-    addOp(opByteSetAddRng);
+    addOp(setType->isByteSet() ? opByteSetAddRng : opIntSetAddRng);
 }
 
 
@@ -1288,6 +1297,28 @@ void CodeGen::stkVarCmpLength(StkVar* var, StkVar* contVar)
 }
 
 
+void CodeGen::stkVarNextElem(StkVar* var)
+{
+    // Moves the loop variable to the next element of a byte set, an int set
+    // or a byte dict, or reads the next line of a char fifo (top of the
+    // stack); leaves true if there are no more elements
+    Type* contType = stkPop();
+    OpCode op = opInv;
+    if (contType->isByteSet())
+        op = opStkVarNextBit;
+    else if (contType->isIntSet())
+        op = opStkVarNextInt;
+    else if (contType->isByteDict())
+        op = opStkVarNextKey;
+    else if (contType->isByteFifo())
+        op = opStkVarNextLine;
+    else
+        fatal(0x600A, "stkVarNextElem(): unsupported type");
+    assert(var->id >= 0 && var->id < 255);
+    addOp<uchar>(queenBee->defBool, op, var->id);
+}
+
+
 void CodeGen::boolJump(memint target, OpCode op)
 {
     assert(isBoolJump(op));
@@ -1353,7 +1384,16 @@ void CodeGen::assertion(integer ln, const str& cond)
 
 void CodeGen::dumpVar(const str& expr)
 {
-    Type* type = stkPop();
+    // The output goes to system.sio of the running context
+    InnerVar* sys = module->findUsedModuleVar(queenBee);
+    if (sys == NULL)
+        fatal(0x600e, "System module not used");
+    Type* type = stkType();
+    loadDataSeg();
+    loadMember(module, sys);
+    loadMember(queenBee, queenBee->sioVar);
+    stkPop();
+    stkPop();
     addOp(opDump, expr.obj);
     add(type);
 }
@@ -1651,6 +1691,7 @@ void CodeGen::call(FuncPtr* proto)
 
 void CodeGen::staticCall(State* callee)
 {
+    callee->compileBody();
     _popArgs(callee->prototype);
     if (callee->prototype->returns)
         addOp<State*>(callee->prototype->returnType, opStaticCall, callee);
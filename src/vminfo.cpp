@@ -129,6 +129,9 @@ OpInfo opTable[] =
     OP(RngToByteSet, None),     // -int -int +set
     OP(ByteSetAddElem, None),   // -int -set +set
     OP(ByteSetAddRng, None),    // -int -int -set +set
+    OP(ElemToIntSet, None),     // -int +set
+    OP(RngToIntSet, None),      // -int -int +set
+    OP(IntSetAddRng, None),     // -int -int -set +set
     OP(InSet, None),            // -set -var +bool
     OP(InByteSet, None),        // -set -int +bool
     OP(InBounds, Type),         // [Ordinal*] -int +bool
@@ -206,6 +209,10 @@ OpInfo opTable[] =
     OP(CaseVar, None),          // -var -var +var +bool
     OP(StkVarGt, StkIdx),       // [stk.idx:u8] -int +bool
     OP(StkVarGe, StkIdx),       // [stk.idx:u8] -int +bool
+    OP(StkVarNextBit, StkIdx),  // [stk.idx:u8] -ordset +bool
+    OP(StkVarNextKey, StkIdx),  // [stk.idx:u8] -vec +bool
+    OP(StkVarNextLine, StkIdx), // [stk.idx:u8] -fifo +bool
+    OP(StkVarNextInt, StkIdx),  // [stk.idx:u8] -intset +bool
 
     // --- 12. JUMPS, CALLS
     OP(Jump, Jump16),           // [dst:s16]
@@ -224,7 +231,7 @@ OpInfo opTable[] =
     // --- 13. DEBUGGING, DIAGNOSTICS
     OP(LineNum, LineNum),       // [linenum:int]
     OP(Assert, Assert),         // [linenum:int, cond:str] -bool
-    OP(Dump, Dump),             // [expr:str, type:Type*] -var
+    OP(Dump, Dump),             // [expr:str, type:Type*] -fifo -var
     OP(Inv, None),              // not used
 };
 
@@ -265,6 +272,7 @@ static const char* varTypeStr(variant::Type type)
         _C(VEC)
         _C(SET)
         _C(ORDSET)
+        _C(INTSET)
         _C(DICT)
         _C(REF)
         _C(RTOBJ)